@@ -0,0 +1,190 @@
+/* MIT License
+
+Copyright (c) 2010 Vladimir Antonov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/* Counts heap allocations of the editor through readline_allocator(). The
+   editor runs behind a pseudo terminal; the first lines warm it up (fill
+   the history and grow its buffers), then every further line must be
+   edited and accepted without a single allocation.
+
+	bench_alloc [lines]
+
+   Prints a JSON object per phase; exits with 1 if the steady phase had any
+   allocations. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/wait.h>
+#include "readline.h"
+
+#define WARM_LINES  200  /* every history slot has seen the longest line */
+
+/* -------------------------------------------------------------------------- */
+static struct {
+	unsigned long mallocs, reallocs, frees;
+} counts;
+
+static void *count_malloc(void *ctx, size_t size)
+{
+	++counts.mallocs;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ctx, void *ptr, size_t size)
+{
+	++counts.reallocs;
+	return realloc(ptr, size);
+}
+
+static void count_free(void *ctx, void *ptr)
+{
+	++counts.frees;
+	free(ptr);
+}
+
+static const rl_allocator_t counting = { count_malloc, count_realloc, count_free, NULL };
+
+/* -------------------------------------------------------------------------- */
+static char const *complete(char const *start, char const *cur_pos)
+{
+	static char const *options[] = { "show", "set", "save", "system", NULL };
+	if (cur_pos == start) {
+		rl_dump_options(options);
+		return NULL;
+	}
+	return "ow ";
+}
+
+/* -------------------------------------------------------------------------- */
+/* The editor side, reports to `report` fd */
+static void editor(int report, char const *history)
+{
+	readline_allocator(&counting);
+	readline_init(complete);
+	readline_history_load(history);
+	readline_suggest(1);
+
+	int lines = 0;
+	char *line;
+	typeof(counts) warm = counts;
+	while ((line = readline("bench> ", NULL)) && strcmp(line, "exit")) {
+		if (++lines == WARM_LINES) {
+			warm = counts;
+			dprintf(report, "{\"bench\":\"alloc\",\"phase\":\"warm\",\"lines\":%d,"
+				"\"mallocs\":%lu,\"reallocs\":%lu,\"frees\":%lu}\n",
+				lines, counts.mallocs, counts.reallocs, counts.frees);
+		}
+	}
+	dprintf(report, "{\"bench\":\"alloc\",\"phase\":\"steady\",\"lines\":%d,"
+		"\"mallocs\":%lu,\"reallocs\":%lu,\"frees\":%lu}\n",
+		lines - WARM_LINES, counts.mallocs - warm.mallocs,
+		counts.reallocs - warm.reallocs, counts.frees - warm.frees);
+
+	readline_free();
+	exit(0);
+}
+
+/* -------------------------------------------------------------------------- */
+static void drain(int fd, int wait_ms)
+{
+	char buf[65536];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	while (poll(&pfd, 1, wait_ms) > 0 && read(fd, buf, sizeof(buf)) > 0)
+		wait_ms = 2;
+}
+
+/* -------------------------------------------------------------------------- */
+static void send(int fd, char const *keys)
+{
+	if (write(fd, keys, strlen(keys)) < 0)
+		exit(2);
+	drain(fd, 50); /* some keys change nothing on the screen */
+}
+
+/* -------------------------------------------------------------------------- */
+/* One line of typing with edits, history browsing and completion */
+static void line(int fd, int n)
+{
+	char text[128];
+	snprintf(text, sizeof(text), "set value%d %.*s", n, n % 40,
+		"0123456789abcdefghijklmnopqrstuvwxyzABCD");
+	send(fd, text);
+	send(fd, "\033[D\033[D\177\033b\033[C");     /* edit in the middle */
+	send(fd, "\020\020\016\016");                /* history back and forth */
+	send(fd, "\025");                            /* kill, then undo it */
+	send(fd, "\037");
+	send(fd, n % 10 ? "\005" : "\001\013\t");   /* completion list sometimes */
+	send(fd, "\r");
+}
+
+/* -------------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+	int lines = argc > 1 ? atoi(argv[1]) : 200;
+
+	char history[] = "/tmp/rl_bench_XXXXXX";
+	int hfd = mkstemp(history);
+	if (hfd < 0)
+		return perror("mkstemp"), 1;
+	close(hfd);
+
+	int report[2];
+	if (pipe(report) < 0)
+		return perror("pipe"), 1;
+
+	struct winsize ws = { .ws_row = 24, .ws_col = 80 };
+	int fd;
+	pid_t pid = forkpty(&fd, NULL, NULL, &ws);
+	if (pid < 0)
+		return perror("forkpty"), 1;
+	if (!pid) {
+		close(report[0]);
+		editor(report[1], history);
+	}
+	close(report[1]);
+
+	drain(fd, 1000);
+	for (int i = 0; i < WARM_LINES + lines; ++i)
+		line(fd, i);
+	send(fd, "exit\r");
+	drain(fd, 1000);
+
+	char result[1024];
+	int length = 0, count;
+	while (length < sizeof(result) - 1 &&
+			(count = read(report[0], result + length, sizeof(result) - 1 - length)) > 0)
+		length += count;
+	result[length] = 0;
+	fputs(result, stdout);
+
+	close(fd);
+	waitpid(pid, NULL, 0);
+	unlink(history);
+
+	char const *steady = strstr(result, "\"steady\"");
+	return !steady || !strstr(steady, "\"mallocs\":0,\"reallocs\":0");
+}
@@ -0,0 +1,116 @@
+/* MIT License
+
+Copyright (c) 2010 Vladimir Antonov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/* Lines/sec of non-interactive input: readline_batch() against the former
+   fgets() path of readline().
+
+	bench_batch [lines] [line length]
+
+   Prints one JSON object per method. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "readline.h"
+
+/* -------------------------------------------------------------------------- */
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* -------------------------------------------------------------------------- */
+/* readline() for non-tty stdin as it was */
+static long read_fgets(size_t *bytes)
+{
+	char raw[1024];
+	long lines = 0;
+	while (fgets(raw, sizeof(raw), stdin)) {
+		char *end = raw + strlen(raw) - 1;
+		while (end >= raw && (*end == '\r' || *end == '\n'))
+			--end;
+		*++end = 0;
+		*bytes += end - raw;
+		++lines;
+	}
+	return lines;
+}
+
+/* -------------------------------------------------------------------------- */
+static long read_batch(size_t *bytes)
+{
+	char const *line;
+	int length;
+	long lines = 0;
+	while ((length = readline_batch(&line)) >= 0) {
+		*bytes += length;
+		++lines;
+	}
+	return lines;
+}
+
+/* -------------------------------------------------------------------------- */
+static void run(char const *name, long (*reader)(size_t *), FILE *input)
+{
+	rewind(input);
+	lseek(fileno(input), 0, SEEK_SET);
+	dup2(fileno(input), STDIN_FILENO);
+	clearerr(stdin);
+
+	readline_init(NULL);
+	size_t bytes = 0;
+	double start = now();
+	long lines = reader(&bytes);
+	double time = now() - start;
+	readline_free();
+
+	printf("{\"bench\":\"batch\",\"method\":\"%s\",\"lines\":%ld,\"bytes\":%zu,"
+		"\"seconds\":%.6f,\"lines_per_sec\":%.0f}\n",
+		name, lines, bytes, time, lines / time);
+}
+
+/* -------------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+	long lines = argc > 1 ? atol(argv[1]) : 1000000;
+	int length = argc > 2 ? atoi(argv[2]) : 40;
+
+	FILE *input = tmpfile();
+	if (!input)
+		return perror("tmpfile"), 1;
+
+	for (long i = 0; i < lines; ++i)
+		fprintf(input, "set interface eth%ld mtu %*d\n", i % 48, length > 30 ? length - 30 : 1, (int)(i % 9000));
+	fflush(input);
+
+	run("fgets", read_fgets, input);
+	run("readline_batch", read_batch, input);
+
+	fclose(input);
+	return 0;
+}
@@ -0,0 +1,305 @@
+/* MIT License
+
+Copyright (c) 2010 Vladimir Antonov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/* End-to-end cost of the editor seen through a pseudo terminal: the editor
+   runs in a child process behind openpty(), keys are written to the master
+   side and the output is timed and counted there.
+
+	bench_pty [ops per test]
+
+   Prints one JSON object per test:
+     latency_us     -- from writing a key to the last byte of its echo
+     bytes_per_op   -- bytes the editor wrote to the terminal
+     cpu_us_per_op  -- CPU time of the editor (/proc/PID/schedstat)
+     reads_per_op, writes_per_op -- syscalls of the editor (/proc/PID/io) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "readline.h"
+
+#ifndef countof
+# define countof(arr)  (sizeof(arr)/sizeof(arr[0]))
+#endif
+
+#define QUIET_MS  3   /* output is complete after so long silence */
+
+static int ops = 200;
+
+/* -------------------------------------------------------------------------- */
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+/* -------------------------------------------------------------------------- */
+/* The editor side */
+static char const *complete_all(char const *start, char const *cur_pos)
+{
+	static char names[500][16];
+	static char const *options[countof(names) + 1];
+	for (int i = 0; i < countof(names); ++i)
+		snprintf(names[i], sizeof(names[i]), "option%03d", i), options[i] = names[i];
+	options[countof(names)] = NULL;
+
+	rl_dump_options(options);
+	return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+static void editor(char const *history)
+{
+	readline_init(complete_all);
+	readline_history_load(history);
+	char *line;
+	while ((line = readline("bench> ", NULL)) && strcmp(line, "exit"))
+		;
+	readline_free();
+	exit(0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* The terminal side */
+typedef
+struct {
+	int fd;
+	pid_t pid;
+} term_t;
+
+typedef
+struct {
+	long rchar, wchar, syscr, syscw;
+} io_t;
+
+/* -------------------------------------------------------------------------- */
+static io_t proc_io(pid_t pid)
+{
+	io_t io = { -1, -1, -1, -1 };
+	char name[64], key[32];
+	long value;
+	snprintf(name, sizeof(name), "/proc/%d/io", (int)pid);
+	FILE *f = fopen(name, "r");
+	if (!f)
+		return io;
+
+	while (fscanf(f, "%31[^:]: %ld\n", key, &value) == 2)
+		if (!strcmp(key, "rchar")) io.rchar = value;
+		else if (!strcmp(key, "wchar")) io.wchar = value;
+		else if (!strcmp(key, "syscr")) io.syscr = value;
+		else if (!strcmp(key, "syscw")) io.syscw = value;
+	fclose(f);
+	return io;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Time on CPU in ns, -1 if unknown */
+static double proc_cpu_ns(pid_t pid)
+{
+	char name[64];
+	double ns = -1;
+	snprintf(name, sizeof(name), "/proc/%d/schedstat", (int)pid);
+	FILE *f = fopen(name, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%lf", &ns) != 1)
+		ns = -1;
+	fclose(f);
+	return ns;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Reads the output until it is quiet. Returns count of bytes, *last is the
+   time of the last byte. */
+static long drain(term_t *t, int wait_ms, double *last)
+{
+	char buf[65536];
+	long total = 0;
+	struct pollfd pfd = { .fd = t->fd, .events = POLLIN };
+	while (poll(&pfd, 1, total ? QUIET_MS : wait_ms) > 0) {
+		int count = read(t->fd, buf, sizeof(buf));
+		if (count <= 0)
+			break;
+		total += count;
+		if (last)
+			*last = now_us();
+	}
+	return total;
+}
+
+/* -------------------------------------------------------------------------- */
+static void send(term_t *t, char const *keys, int length)
+{
+	while (length > 0) {
+		int count = write(t->fd, keys, length);
+		if (count <= 0)
+			exit(2);
+		keys += count;
+		length -= count;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+static void setup(term_t *t, char const *keys)
+{
+	send(t, keys, strlen(keys));
+	drain(t, 1000, NULL);
+}
+
+/* -------------------------------------------------------------------------- */
+static int cmp_double(void const *l, void const *r)
+{
+	double a = *(double const *)l, b = *(double const *)r;
+	return a < b ? -1 : a > b;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Sends `count` times the keys, each time waiting for the whole echo. Keys
+   which arrive together are edited in one frame, so an operation and its
+   reverse (home/end) are alternated as separate operations. */
+static void measure(term_t *t, char const *name, char const *keys, char const *back, int count)
+{
+	double *lat = calloc(count, sizeof(double)), sum = 0;
+	long bytes = 0;
+
+	io_t io0 = proc_io(t->pid);
+	double cpu0 = proc_cpu_ns(t->pid);
+	for (int i = 0; i < count; ++i) {
+		double start = now_us(), last = start;
+		char const *key = back && i % 2 ? back : keys;
+		send(t, key, strlen(key));
+		bytes += drain(t, 1000, &last);
+		lat[i] = last - start;
+		sum += lat[i];
+	}
+	io_t io1 = proc_io(t->pid);
+	double cpu1 = proc_cpu_ns(t->pid);
+
+	qsort(lat, count, sizeof(*lat), cmp_double);
+	printf("{\"bench\":\"pty\",\"test\":\"%s\",\"ops\":%d,"
+		"\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+		"\"bytes_per_op\":%.1f,\"cpu_us_per_op\":%.2f,\"reads_per_op\":%.2f,\"writes_per_op\":%.2f}\n",
+		name, count,
+		sum / count, lat[count / 2], lat[count * 99 / 100], lat[count - 1],
+		(double)bytes / count,
+		cpu0 < 0 ? -1. : (cpu1 - cpu0) / count / 1000,
+		io0.syscr < 0 ? -1. : (double)(io1.syscr - io0.syscr) / count,
+		io0.syscw < 0 ? -1. : (double)(io1.syscw - io0.syscw) / count);
+	fflush(stdout);
+	free(lat);
+}
+
+/* -------------------------------------------------------------------------- */
+static void repeat(char *to, char const *what, int count)
+{
+	*to = 0;
+	while (count--)
+		strcat(to, what);
+}
+
+/* -------------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		ops = atoi(argv[1]);
+	if (ops < 1)
+		ops = 1;
+
+	char history[] = "/tmp/rl_bench_XXXXXX";
+	int hfd = mkstemp(history);
+	if (hfd < 0)
+		return perror("mkstemp"), 1;
+	for (int i = 0; i < 64; ++i)
+		dprintf(hfd, "show interface eth%d statistics detail %d\n", i, i * 7);
+	close(hfd);
+
+	struct winsize ws = { .ws_row = 24, .ws_col = 80 };
+	term_t t;
+	t.pid = forkpty(&t.fd, NULL, NULL, &ws);
+	if (t.pid < 0)
+		return perror("forkpty"), 1;
+	if (!t.pid)
+		editor(history);
+
+	drain(&t, 1000, NULL); /* prompt */
+
+	char line[4096];
+
+	/* typing at the end of line, and of a 800 chars one */
+	measure(&t, "append", "x", NULL, ops);
+	char text[2][1024], burst[2][1100];
+	repeat(text[0], "long line ", 80);
+	snprintf(burst[0], sizeof(burst[0]), "\025%s", text[0]);
+	setup(&t, burst[0]);
+	measure(&t, "append_long", "x", NULL, ops > 200 ? 200 : ops);
+
+	/* editing in the middle of a 70 chars line */
+	repeat(line, "\033[D", 35);
+	setup(&t, "\025abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqr");
+	setup(&t, line);
+	measure(&t, "insert_mid", "y", NULL, ops);
+	measure(&t, "delete_mid", "\004", NULL, ops > 30 ? 30 : ops);
+	measure(&t, "backspace_mid", "\177", NULL, ops > 30 ? 30 : ops);
+
+	setup(&t, "\025");
+	repeat(line, "word ", 100);
+	setup(&t, line);
+	measure(&t, "cursor_left", "\033[D", NULL, ops);
+	measure(&t, "cursor_right", "\033[C", NULL, ops);
+	measure(&t, "word_left", "\033b", NULL, ops > 90 ? 90 : ops);
+	measure(&t, "home_end", "\001", "\005", ops);
+
+	/* history recall */
+	setup(&t, "\025");
+	measure(&t, "history_prev_next", "\020", "\016", ops);
+	measure(&t, "history_first_last", "\033<", "\033>", ops);
+
+	/* paste of 1000 chars as one piece, and the same typed in one burst;
+	   two texts alternate, an unchanged line would not be redrawn */
+	setup(&t, "\025");
+	repeat(text[0], "paste ", 166);
+	repeat(text[1], "PASTE ", 166);
+	for (int i = 0; i < 2; ++i)
+		snprintf(burst[i], sizeof(burst[i]), "\025\033[200~%s\033[201~", text[i]);
+	measure(&t, "paste_1000", burst[0], burst[1], ops > 50 ? 50 : ops);
+	for (int i = 0; i < 2; ++i)
+		snprintf(burst[i], sizeof(burst[i]), "\025%s", text[i]);
+	measure(&t, "burst_1000", burst[0], burst[1], ops > 50 ? 50 : ops);
+
+	/* listing of 500 completion options */
+	setup(&t, "\025");
+	measure(&t, "completion_list_500", "\t", NULL, ops > 50 ? 50 : ops);
+
+	setup(&t, "\025exit\r");
+	close(t.fd);
+	waitpid(t.pid, NULL, 0);
+	unlink(history);
+	return 0;
+}
@@ -0,0 +1,275 @@
+/* MIT License
+
+Copyright (c) 2010 Vladimir Antonov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/* Load of the CLI server example: many local clients type into their own
+   editor sessions of one server process.
+
+	bench_server SERVER [sessions] [rounds]
+
+   SERVER is examples/example_server, it is started on a Unix socket. Every
+   round each client (or only the first one, test "single") sends the next
+   key of "system status\r" and waits for the echo. Prints JSON objects:
+     kb_per_session -- growth of the server's RSS per connected session
+     cpu_us_per_key -- user + system time of the server per key
+     latency_us     -- from sending a key to the first byte of its echo */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define QUIET_MS  2   /* the echo of a round is complete after so long silence */
+
+static char const keys[] = "system status\r";
+
+typedef
+struct {
+	int fd;
+	double sent;
+	int answered;
+} conn_t;
+
+/* -------------------------------------------------------------------------- */
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+/* -------------------------------------------------------------------------- */
+static long proc_rss_kb(pid_t pid)
+{
+	char name[64], line[256];
+	long kb = -1;
+	snprintf(name, sizeof(name), "/proc/%d/status", (int)pid);
+	FILE *f = fopen(name, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+/* -------------------------------------------------------------------------- */
+/* user + system time in us */
+static double proc_cpu_us(pid_t pid)
+{
+	char name[64];
+	unsigned long utime, stime;
+	snprintf(name, sizeof(name), "/proc/%d/stat", (int)pid);
+	FILE *f = fopen(name, "r");
+	if (!f)
+		return -1;
+	int got = fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime);
+	fclose(f);
+	return got == 2 ? (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK) : -1;
+}
+
+/* -------------------------------------------------------------------------- */
+static int connect_to(char const *path)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Reads what a client has got, returns count of bytes */
+static long receive(conn_t *c)
+{
+	char buf[65536];
+	long total = 0;
+	int count;
+	while ((count = read(c->fd, buf, sizeof(buf))) > 0)
+		total += count;
+	if (!count) {
+		fprintf(stderr, "the server closed a session\n");
+		exit(2);
+	}
+	return total;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Waits until `pending` clients are answered, then for the rest of the echo */
+static long collect(int ep, int pending, double *lat, int *nlat)
+{
+	struct epoll_event ev[256];
+	long bytes = 0;
+	while (pending > 0) {
+		int n = epoll_wait(ep, ev, 256, 5000);
+		if (n <= 0) {
+			fprintf(stderr, "no answer from %d sessions\n", pending);
+			exit(2);
+		}
+		double now = now_us();
+		for (int i = 0; i < n; ++i) {
+			conn_t *c = ev[i].data.ptr;
+			bytes += receive(c);
+			if (!c->answered) {
+				c->answered = 1;
+				--pending;
+				if (lat)
+					lat[(*nlat)++] = now - c->sent;
+			}
+		}
+	}
+
+	int n;
+	while ((n = epoll_wait(ep, ev, 256, QUIET_MS)) > 0)
+		for (int i = 0; i < n; ++i)
+			bytes += receive(ev[i].data.ptr);
+	return bytes;
+}
+
+/* -------------------------------------------------------------------------- */
+static int cmp_double(void const *l, void const *r)
+{
+	double a = *(double const *)l, b = *(double const *)r;
+	return a < b ? -1 : a > b;
+}
+
+/* -------------------------------------------------------------------------- */
+static void measure(char const *name, pid_t pid, int ep, conn_t *conns, int active, int sessions, int rounds)
+{
+	int total = active * rounds, nlat = 0;
+	double *lat = calloc(total, sizeof(double)), sum = 0;
+	long bytes = 0;
+
+	double cpu0 = proc_cpu_us(pid);
+	for (int r = 0; r < rounds; ++r) {
+		char key = keys[r % (sizeof(keys) - 1)];
+		for (int i = 0; i < active; ++i) {
+			conns[i].answered = 0;
+			conns[i].sent = now_us();
+			if (write(conns[i].fd, &key, 1) != 1)
+				exit(2);
+		}
+		bytes += collect(ep, active, lat, &nlat);
+	}
+	double cpu1 = proc_cpu_us(pid);
+
+	for (int i = 0; i < nlat; ++i)
+		sum += lat[i];
+	qsort(lat, nlat, sizeof(*lat), cmp_double);
+	printf("{\"bench\":\"server\",\"test\":\"%s\",\"sessions\":%d,\"keys\":%d,"
+		"\"cpu_us_per_key\":%.2f,"
+		"\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+		"\"bytes_per_key\":%.1f}\n",
+		name, sessions, nlat,
+		cpu0 < 0 ? -1. : (cpu1 - cpu0) / nlat,
+		sum / nlat, lat[nlat / 2], lat[nlat * 99 / 100], lat[nlat * 999 / 1000], lat[nlat - 1],
+		(double)bytes / nlat);
+	fflush(stdout);
+	free(lat);
+}
+
+/* -------------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: bench_server SERVER [sessions] [rounds]\n");
+		return 1;
+	}
+	int sessions = argc > 2 ? atoi(argv[2]) : 1000;
+	int rounds = argc > 3 ? atoi(argv[3]) : 100;
+	if (sessions < 1)
+		sessions = 1;
+	if (rounds < 1)
+		rounds = 1;
+
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/rl_bench_server_%d.sock", (int)getpid());
+	pid_t pid = fork();
+	if (pid < 0)
+		return perror("fork"), 1;
+	if (!pid) {
+		execl(argv[1], argv[1], path, (char *)NULL);
+		perror(argv[1]);
+		_exit(1);
+	}
+
+	int probe = -1;
+	for (int i = 0; i < 200 && (probe = connect_to(path)) < 0; ++i)
+		usleep(10000);
+	if (probe < 0)
+		return fprintf(stderr, "the server does not listen\n"), 1;
+	close(probe);
+	usleep(50000);
+
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	conn_t *conns = calloc(sessions, sizeof(conn_t));
+	long rss0 = proc_rss_kb(pid);
+	double start = now_us();
+	for (int i = 0; i < sessions; ++i) {
+		if ((conns[i].fd = connect_to(path)) < 0)
+			return fprintf(stderr, "connect %d: %m\n", i), 1;
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conns + i };
+		epoll_ctl(ep, EPOLL_CTL_ADD, conns[i].fd, &ev);
+	}
+	collect(ep, sessions, NULL, NULL); /* prompts */
+	double connected = now_us();
+	long rss1 = proc_rss_kb(pid);
+
+	printf("{\"bench\":\"server\",\"test\":\"sessions\",\"sessions\":%d,"
+		"\"connect_ms\":%.1f,\"rss_kb\":%ld,\"kb_per_session\":%.2f}\n",
+		sessions, (connected - start) / 1000, rss1,
+		rss0 < 0 ? -1. : (double)(rss1 - rss0) / sessions);
+	fflush(stdout);
+
+	measure("single", pid, ep, conns, 1, sessions, rounds);
+	measure("all", pid, ep, conns, sessions, sessions, rounds);
+
+	for (int i = 0; i < sessions; ++i)
+		close(conns[i].fd);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	unlink(path);
+	return 0;
+}
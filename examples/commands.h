@@ -0,0 +1,42 @@
+/* MIT License
+
+Copyright (c) 2010 Vladimir Antonov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef COMMANDS_H_
+#define COMMANDS_H_
+
+/* -------------------------------------------------------------------------- */
+typedef
+struct _ac_ {
+	char const *name;
+	struct _ac_ const *const sub;
+} ac_item_t;
+
+extern const ac_item_t ac_root[];
+extern char const *rl_styles[];
+
+char const *rl_get_completion(char const *start, char const *cur_pos);
+int rl_highlight(char const *line, int from, int to, rl_span_t *spans, int max_spans);
+int is_cmd(char const *line, char const *cmd);
+
+#endif /* COMMANDS_H_ */
@@ -0,0 +1,83 @@
+/* MIT License
+
+Copyright (c) 2010 Vladimir Antonov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include <stdio.h>
+#include "readline.hpp"
+
+/* -------------------------------------------------------------------------- */
+/* Coroutine started at once and never awaited */
+struct task {
+	struct promise_type {
+		task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() {}
+	};
+};
+
+/* -------------------------------------------------------------------------- */
+/* A timer ticking next to the console on the same loop */
+static task ticker(rl::poll_loop &loop, bool const &done)
+{
+	struct sleep {
+		rl::poll_loop &loop;
+		int ms;
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h) { loop.wait(-1, ms, [h] { h.resume(); }); }
+		void await_resume() {}
+	};
+
+	for (int i = 1; !done; ++i) {
+		co_await sleep { loop, 3000 };
+		if (!done)
+			rl_print_async("tick %d", i);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+static task console(rl::session &rl, rl::poll_loop &loop, bool &done)
+{
+	for (;;) {
+		rl::line line = co_await rl.read_line(loop, "coro> ");
+		if (!line || line.text == "exit")
+			break;
+		printf("got '%.*s'\n", (int)line.text.size(), line.text.data());
+	}
+	done = true;
+}
+
+/* -------------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+	rl::session rl;
+	rl::poll_loop loop;
+	bool done = false;
+
+	console(rl, loop, done);
+	ticker(loop, done);
+	while (!done)
+		loop.run_once();
+	return 0;
+}
@@ -0,0 +1,279 @@
+/* MIT License
+
+Copyright (c) 2010 Vladimir Antonov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/* CLI server: every client of a TCP or a Unix socket gets its own editor
+   session, one epoll loop runs all of them.
+
+	example_server [port | socket path]
+
+   The client's terminal must be raw, the editor echoes the keys itself:
+	socat -,raw,echo=0 TCP:localhost:7070
+	socat -,raw,echo=0 UNIX-CONNECT:/tmp/cli.sock */
+
+#define _GNU_SOURCE /* accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "readline.h"
+#include "commands.h"
+
+#define PROMPT      "ogo>"
+#define MAX_EVENTS  256
+
+/* -------------------------------------------------------------------------- */
+typedef
+struct client {
+	int fd;
+	rl_session_t *rl;
+	unsigned events;    /* epoll interest */
+	long due;           /* ms, readline_step() wants to be called then, 0 -- on input */
+	struct client *next, *prev;
+} client_t;
+
+static int ep;
+static int notify;          /* epoll tag of readline_notify_fd() */
+static client_t *clients;  /* all of them, see client_timers() */
+static int count, timed;    /* of clients, of clients with `due` */
+
+/* -------------------------------------------------------------------------- */
+static long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* -------------------------------------------------------------------------- */
+static void client_due(client_t *c, long due)
+{
+	timed += !!due - !!c->due;
+	c->due = due;
+}
+
+/* -------------------------------------------------------------------------- */
+static void client_close(client_t *c)
+{
+	readline_session_free(c->rl);
+	close(c->fd);
+	client_due(c, 0);
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		clients = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	--count;
+	free(c);
+}
+
+/* -------------------------------------------------------------------------- */
+static void client_exec(char const *line)
+{
+	char out[1200];
+	int length = snprintf(out, sizeof(out), "exec '%s' (%d sessions)\r\n", line, count);
+	readline_write(out, length < sizeof(out) ? length : sizeof(out) - 1);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Applies the input the client has sent, runs the lines entered */
+static void client_run(client_t *c)
+{
+	readline_session(c->rl);
+	for (;;) {
+		char *line;
+		int wait, ret = readline_step(&line, &wait);
+		if (ret == RL_AGAIN) {
+			client_due(c, wait < 0 ? 0 : now_ms() + wait);
+			break;
+		}
+		if (ret < 0 || is_cmd(line, "exit")) {
+			client_close(c);
+			return;
+		}
+		client_exec(line);
+		readline_start(PROMPT, NULL);
+	}
+
+	/* no keys are taken while the client does not read its output */
+	int pending = readline_flush();
+	if (pending < 0) {
+		client_close(c);
+		return;
+	}
+	unsigned events = pending ? EPOLLOUT : EPOLLIN;
+	if (events != c->events) {
+		struct epoll_event ev = { .events = events, .data.ptr = c };
+		epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+		c->events = events;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+static void client_accept(int lfd)
+{
+	int fd, one = 1;
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); /* fails for Unix */
+
+		client_t *c = calloc(1, sizeof(*c));
+		if (!c || !(c->rl = readline_session_new(fd, fd, 80))) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->events = EPOLLIN;
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+		epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+		if ((c->next = clients))
+			clients->prev = c;
+		clients = c;
+		++count;
+
+		readline_session(c->rl);
+		readline_start(PROMPT, NULL);
+		client_run(c);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* Runs the clients whose time has come, returns ms to the next one */
+static int client_timers()
+{
+	if (!timed)
+		return -1;
+
+	long now = now_ms(), next = -1;
+	for (client_t *c = clients, *n; c; c = n) {
+		n = c->next;
+		if (!c->due)
+			continue;
+		if (c->due <= now)
+			client_run(c);
+		else
+			if (next < 0 || c->due - now < next)
+				next = c->due - now;
+	}
+	return next;
+}
+
+/* -------------------------------------------------------------------------- */
+/* The notice pipe is one for all the sessions: every client shows the
+   prompt segments set meanwhile */
+static void client_notified()
+{
+	char buf[64];
+	while (read(readline_notify_fd(), buf, sizeof(buf)) > 0)
+		;
+	for (client_t *c = clients, *n; c; c = n) {
+		n = c->next;
+		client_run(c);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+static int listen_on(char const *where)
+{
+	int fd, one = 1;
+	if (strchr(where, '/')) {
+		struct sockaddr_un sa = { .sun_family = AF_UNIX };
+		strncpy(sa.sun_path, where, sizeof(sa.sun_path) - 1);
+		unlink(where);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+			return -1;
+	} else {
+		struct sockaddr_in sa = {
+			.sin_family = AF_INET,
+			.sin_port = htons(atoi(where)),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+		};
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+			return -1;
+	}
+	return listen(fd, 4096) < 0 ? -1 : fd;
+}
+
+/* -------------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) { /* a fd per client */
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	int lfd = listen_on(argc > 1 ? argv[1] : "7070");
+	if (lfd < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	/* sessions take the settings of the main editor */
+	if (readline_init(rl_get_completion) < 0)
+		return 1;
+	readline_highlight(rl_highlight, rl_styles);
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+	ev.data.ptr = &notify;
+	epoll_ctl(ep, EPOLL_CTL_ADD, readline_notify_fd(), &ev);
+
+	struct epoll_event events[MAX_EVENTS];
+	for (;;) {
+		int n = epoll_wait(ep, events, MAX_EVENTS, client_timers());
+		if (n < 0 && errno != EINTR)
+			break;
+		int notified = 0;
+		for (int i = 0; i < n; ++i)
+			if (!events[i].data.ptr)
+				client_accept(lfd);
+			else
+				if (events[i].data.ptr == &notify)
+					notified = 1; /* after the batch, it may close clients of it */
+				else
+					client_run(events[i].data.ptr);
+		if (notified)
+			client_notified();
+	}
+
+	while (clients)
+		client_close(clients);
+	readline_free();
+	return 0;
+}
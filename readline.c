@@ -31,24 +31,41 @@ SOFTWARE.
 #define __USE_GNU
 
 #include <string.h>
+#include <stddef.h>
 #include <termios.h>
 #include <errno.h>
 #include <syslog.h>
 #include <signal.h>
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
+
+#include <fcntl.h>
 
 #ifndef TIOCGWINSZ
 # include <sys/ioctl.h>
 #endif
-#include <sys/time.h>
 
 #include "config.h"
 
 #include "readline.h"
+#include "rl_width.h"
 
 #ifdef RL_HISTORY_FILE
 # include <sys/stat.h>
-# include <fcntl.h>
+#endif
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+
+#ifdef RL_TRACE
+# include <sys/stat.h>
+# include <sys/uio.h>
 #endif
 
 /*
@@ -57,7 +74,7 @@ SOFTWARE.
 [*] commands dispatcher
 [*] commands handlers
 [*] history control
-[ ] undo buffer
+[*] undo buffer
 */
 
 #define STATIC static
@@ -70,20 +87,48 @@ SOFTWARE.
 #define CUR_RIGHT_N "\033[%uC"
 #define CUR_LEFT_N  "\033[%uD"
 
+#define CLEAR_EOS   "\033[J"
+#define CLEAR_EOL   "\033[K"
+
 #define SET_WRAP_MODE "\033[?7h"
 
+#define RL_BATCH_BUFFER  65536 /* initial size of non-interactive input buffer */
+
+#ifndef RL_OUTPUT_MAX
+# define RL_OUTPUT_MAX   65536
+#endif
+
+#ifndef RL_HISTORY_TOP
+# define RL_HISTORY_TOP  16
+#endif
+
+#ifndef RL_HISTORY_HALFLIFE
+# define RL_HISTORY_HALFLIFE 604800
+#endif
+
+#define PASTE_ON    "\033[?2004h"
+#define PASTE_OFF   "\033[?2004l"
+#define PASTE_BEGIN "\033[200~"
+#define PASTE_END   "\033[201~"
+
 /* -------------------------------------------------------------------------- */
 #ifndef RL_USE_WRITE
 
 #define rl_out_purge() do { fflush(stdout); } while(0)
 #define rl_out(data, size) do { fwrite(data, size, 1, stdout); } while(0)
 #define rl_printf(...) do { printf(__VA_ARGS__); } while(0)
+#define rl_out_pending() 0
+#define rl_out_drain() do { fflush(stdout); } while(0)
+#define rl_out_failed() ferror(stdout)
+#define rl_out_init() do { clearerr(stdout); } while(0)
+#define rl_out_free() do { fflush(stdout); } while(0)
 
 #else
 
 static void rl_out(char const *data, int size);
 static void rl_out_purge();
 static void rl_printf(char const *fmt, ...);
+#define rl_out_failed() (rl_output.error)
 
 #endif
 
@@ -95,28 +140,115 @@ static void rl_printf(char const *fmt, ...);
 /* -------------------------------------------------------------------------- */
 typedef unsigned int rl_glyph_t;
 
+/* -------------------------------------------------------------------------- */
+typedef
+struct rl_trie_node {
+	int child, next, parent;         /* node indices, 0 - none */
+	unsigned int best;               /* id of the best ranked line through the node */
+	unsigned int end;                /* id of the line ending at the node, 0 - none */
+	unsigned short count;            /* of lines through the node */
+	unsigned char byte;
+} rl_trie_node_t;
+
+/* -------------------------------------------------------------------------- */
+typedef
+struct rl_history_entry {
+	unsigned int id;                 /* seq of the last use, ascending in lines[] */
+	unsigned int hash;
+	unsigned int time;               /* of the last use, s */
+	unsigned short count;            /* of uses */
+	float rank;                      /* see history_rank() */
+} rl_history_entry_t;
+
 /* -------------------------------------------------------------------------- */
 typedef 
 struct rl_history {
 	char const *file;
-	char *line;
-	char *lines[RL_HISTORY_HEIGHT];
+	char *line;                      /* the edited line while history is browsed */
+	int line_size, line_saved;
+	char *lines[RL_HISTORY_HEIGHT];  /* by the last use, the oldest first */
+	int sizes[RL_HISTORY_HEIGHT];    /* of lines[] buffers, spare ones are kept behind `size` */
+	rl_history_entry_t meta[RL_HISTORY_HEIGHT];
 	int size, current;
+	unsigned int seq;                /* count of lines ever added, the last one's seq */
+
+	unsigned int top[RL_HISTORY_TOP]; /* ids of the best ranked lines, the best first */
+	int top_count;
+
+	rl_trie_node_t *trie;            /* prefix index of lines, see history_suggest() */
+	int trie_size, trie_free;        /* node 0 is the root */
 } rl_history_t;
 
+/* -------------------------------------------------------------------------- */
+typedef
+struct rl_tok {
+	unsigned char state, need, length, broken;
+	char seq[16];
+} rl_tok_t;
+
 /* -------------------------------------------------------------------------- */
 typedef 
 struct _rl_state {
-	char raw[RL_MAX_LENGTH];         /* utf-8 */
+	char raw[RL_MAX_LENGTH*4];       /* utf-8 */
 	rl_glyph_t line[RL_MAX_LENGTH];  /* unicode */
 	int length, cur_pos;             /* length and position in glyphs */
 
+	int col[RL_MAX_LENGTH + 1];      /* screen column in front of each glyph */
+	int cols_valid;                  /* count of actual col[] entries */
+	int shown_cols[RL_MAX_LENGTH + 1]; /* col[] of the shown line, the row index */
+
+	rl_glyph_t shown[RL_MAX_LENGTH]; /* line as it is on the screen now */
+	int shown_length;
+	int shown_col, shown_end;        /* cursor and end of line on the screen */
+	int drawn;                       /* shown[] and shown_attr[] are the line as it is */
+
+	unsigned char attr[RL_MAX_LENGTH];       /* style of each glyph, see rl_highlight() */
+	unsigned char shown_attr[RL_MAX_LENGTH];
+	int hl_from, hl_to;              /* glyphs to highlight again, none if from > to */
+	int sgr;                         /* style the terminal draws with now */
+	int ghost_hidden;                /* no suggestion after the line, see rl_ghost() */
+
+	char input[256];                 /* read ahead, kept between calls */
+	int in_pos, in_top;
+	rl_tok_t tok;                    /* input sequence being parsed */
+	int pasting;                     /* in a bracketed paste, see rl_paste() */
+	int paste_length, paste_matched, paste_prev;
+	char paste[RL_MAX_LENGTH*4];
+	long last_frame;                 /* ms, time of the last render */
+	int frame_due;                   /* a frame waits for the queued output to go */
+	long frame_at;                   /* ms, time a held back frame is due, 0 -- none */
+	int stepping;                    /* driven by readline_step(), which must not block */
+	long last_messages;              /* ms, time rl_print_async() output was shown */
+	long last_input;                 /* ms, time of the last keys read */
+	int idle;                        /* ms to wait for keys, 0 -- forever */
+	long deadline;                   /* ms, time to give the line up or 0 */
+	int timed_out;
+
 	int finish;
+	int echoed;                      /* the terminal has shown the line and Enter */
+	int linemode, in_linemode;       /* the terminal edits lines itself */
+	int in_fd, out_fd;               /* the terminal */
+	int remote;                      /* not the process terminal, see readline_session_new() */
+	int eof;                         /* the line was ended by the end of input */
+	int keep_raw;                    /* the terminal stays raw between lines */
 	rl_history_t history;
 
+#ifdef RL_UNDO_SIZE
+	unsigned char undo[RL_UNDO_SIZE]; /* edits log, see undo_push() */
+	int undo_top, undo_end;          /* end of done and of undone records */
+	int undo_busy;
+#endif
+
 	char const *prompt;
 	int prompt_width;
+	rl_prompt_t *compiled;           /* shown for a NULL prompt, see readline_prompt() */
 	rl_get_completion_fn *_get_completion;
+	rl_highlight_fn *_highlight;
+	char const * const *styles;
+	int styles_count;
+
+	char *batch;                     /* non-interactive input, see readline_batch() */
+	int batch_size, batch_pos, batch_scan, batch_top, batch_eof;
 } rl_state_t;
 
 /* -------------------------------------------------------------------------- */
@@ -128,50 +260,309 @@ struct _rl_command {
 /* -------------------------------------------------------------------------- */
 static rl_state_t *rl_state;
 
+#define RL_IN  (rl_state->in_fd)
+#define RL_OUT (rl_state->out_fd)
+
+/* -------------------------------------------------------------------------- */
+static void *rl_libc_malloc(void *ctx, size_t size)              { return malloc(size); }
+static void *rl_libc_realloc(void *ctx, void *ptr, size_t size) { return realloc(ptr, size); }
+static void  rl_libc_free(void *ctx, void *ptr)                 { free(ptr); }
+
+static const rl_allocator_t rl_libc_allocator = {
+	rl_libc_malloc, rl_libc_realloc, rl_libc_free, NULL
+};
+
+static rl_allocator_t rl_alloc = {
+	rl_libc_malloc, rl_libc_realloc, rl_libc_free, NULL
+};
+
+#define rl_malloc(size)       (rl_alloc.malloc(rl_alloc.ctx, (size)))
+#define rl_realloc(ptr, size) (rl_alloc.realloc(rl_alloc.ctx, (ptr), (size)))
+#define rl_free(ptr)          (rl_alloc.free(rl_alloc.ctx, (ptr)))
+
+/* -------------------------------------------------------------------------- */
+void readline_allocator(rl_allocator_t const *allocator)
+{
+	rl_alloc = allocator ? *allocator : rl_libc_allocator;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Copies the string into a buffer which is reused and grows by powers of two.
+   Returns NULL if the buffer could not grow. */
+static char *rl_strstore(char **buf, int *size, char const *str)
+{
+	int length = strlen(str) + 1;
+	if (length > *size) {
+		int new_size = *size ? *size : 32;
+		while (new_size < length)
+			new_size *= 2;
+
+		char *new_buf = rl_malloc(new_size);
+		if (!new_buf)
+			return NULL;
+		if (*buf)
+			rl_free(*buf);
+		*buf = new_buf;
+		*size = new_size;
+	}
+	return memcpy(*buf, str, length);
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_insert_seq(char const *seq, int flags);
+STATIC char const *history_suggest(char const *prefix, int length);
+STATIC void rl_files_free();
+STATIC void rl_prompt_update();
+static void rl_prompt_row(char const *prompt);
+STATIC void rl_frame();
+
+#ifdef RL_TRACE
+/* -------------------------------------------------------------------------- */
+/* A trace is RL_TRACE_MAGIC and records of
+	type, ms since the previous record (varint), value (varint)[, bytes]
+   'W' -- window width, no bytes;
+   'H' -- history line (at the start);
+   'L' -- prompt of a new line, 'S' -- its initial text;
+   'I' -- input as it was read, 0 bytes -- end of input. */
+#define RL_TRACE_MAGIC "rl-trace 1\n"
+
+typedef
+struct rl_trace_rec {
+	int type;
+	long due;                        /* ms, time of the record in the trace */
+	unsigned long value;
+	unsigned char const *data, *next;
+} rl_trace_rec_t;
+
+static struct {
+	int fd;                          /* recording to, -1 - not recording */
+	long last;                       /* ms, time of the last record */
+
+	int replay, timed;
+	unsigned char const *pos, *end;  /* trace being replayed */
+	rl_trace_rec_t rec;              /* the record at pos */
+	unsigned long part;              /* bytes of rec already read */
+	long clock;                      /* ms, trace time of the replay */
+	int cols;
+} rl_trace = { .fd = -1 };
+#endif
+
+/* -------------------------------------------------------------------------- */
+static long rl_now()
+{
+#ifdef RL_TRACE
+	if (rl_trace.replay)
+		return rl_trace.clock;
+#endif
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+#ifdef RL_STATS
+/* -------------------------------------------------------------------------- */
+static rl_stats_t rl_stats_data;
+
+#define STAT_ADD(field, n)     (rl_stats_data.field += (n))
+#define STAT_START(var)        unsigned long var = rl_us()
+#define STAT_TIME(hist, var)   stat_time(hist, var)
+
+/* -------------------------------------------------------------------------- */
+static unsigned long rl_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* -------------------------------------------------------------------------- */
+static void stat_time(rl_histogram_t *h, unsigned long start)
+{
+	unsigned long us = rl_us() - start;
+	int bucket = 0;
+	while (bucket < RL_STATS_BUCKETS - 1 && us >> bucket)
+		++bucket;
+
+	++h->count;
+	h->total_us += us;
+	if (h->max_us < us)
+		h->max_us = us;
+	++h->buckets[bucket];
+}
+#else
+# define STAT_ADD(field, n)    do {} while (0)
+# define STAT_START(var)
+# define STAT_TIME(hist, var)
+#endif
+
+/* -------------------------------------------------------------------------- */
+/* Self-pipe waking the input wait up: 'w' -- SIGWINCH, 'm' -- a message from
+   rl_print_async(), 'p' -- a prompt segment from rl_prompt_set() */
+static int rl_notify[2] = { -1, -1 };
+
+/* -------------------------------------------------------------------------- */
+static void rl_notify_send(char const *what)
+{
+	int err = errno;
+	if (write(rl_notify[1], what, 1) < 0)
+		; /* the pipe is full, so there is a notice already */
+	errno = err;
+}
+
+/* -------------------------------------------------------------------------- */
+static void rl_notify_init()
+{
+	if (rl_notify[0] >= 0 || pipe(rl_notify) < 0)
+		return;
+
+	for (int i = 0; i < 2; ++i) {
+		fcntl(rl_notify[i], F_SETFL, O_NONBLOCK);
+		fcntl(rl_notify[i], F_SETFD, FD_CLOEXEC);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+static void rl_notify_free()
+{
+	if (rl_notify[0] < 0)
+		return;
+
+	close(rl_notify[0]);
+	close(rl_notify[1]);
+	rl_notify[0] = rl_notify[1] = -1;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Messages of rl_print_async(), the newest first. Producers push with CAS,
+   the readline thread takes the whole list at once, so there is no ABA. */
+typedef struct rl_message {
+	struct rl_message *next;
+	int length;
+	char text[];
+} rl_message_t;
+
+static rl_message_t *rl_messages;
+
+/* -------------------------------------------------------------------------- */
+int rl_print_async(char const *fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	int length = vsnprintf(NULL, 0, fmt, va);
+	va_end(va);
+	if (length < 0)
+		return -1;
+
+	rl_message_t *msg = (rl_message_t *)rl_malloc(sizeof(*msg) + length + 1);
+	if (!msg)
+		return -1;
+	va_start(va, fmt);
+	vsnprintf(msg->text, length + 1, fmt, va);
+	va_end(va);
+	msg->length = length;
+
+	rl_message_t *head = __atomic_load_n(&rl_messages, __ATOMIC_RELAXED);
+	do
+		msg->next = head;
+	while (!__atomic_compare_exchange_n(&rl_messages, &head, msg, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (!head) /* the rest have woken the reader up already */
+		rl_notify_send("m");
+	return length;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Takes all the queued messages, the oldest first */
+static rl_message_t *rl_messages_take()
+{
+	if (!__atomic_load_n(&rl_messages, __ATOMIC_RELAXED) || (rl_state && rl_state->remote))
+		return NULL; /* for the process terminal */
+
+	rl_message_t *msg = __atomic_exchange_n(&rl_messages, NULL, __ATOMIC_ACQUIRE), *list = NULL;
+	while (msg) {
+		rl_message_t *next = msg->next;
+		msg->next = list;
+		list = msg;
+		msg = next;
+	}
+	return list;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Prints the messages and frees them. Every message ends with a line break,
+   \r\n when the terminal is raw. */
+static void rl_messages_out(rl_message_t *msg, int raw)
+{
+	while (msg) {
+		char const *text = msg->text, *end = text + msg->length, *eol;
+		while (raw && (eol = memchr(text, '\n', end - text))) {
+			rl_out(text, eol - text);
+			rl_out("\r\n", 2);
+			text = eol + 1;
+		}
+		rl_out(text, end - text);
+		if (!msg->length || end[-1] != '\n')
+			rl_out(raw ? "\r\n" : "\n", 1 + raw);
+
+		rl_message_t *next = msg->next;
+		rl_free(msg);
+		msg = next;
+	}
+}
+
 /* -------------------------------------------------------------------------- */
-STATIC void rl_insert_seq(char const *seq);
+static void rl_messages_print(int raw)
+{
+	rl_messages_out(rl_messages_take(), raw);
+}
 
 #ifdef RL_WINDOW_WIDTH
 
 struct {
 	int cols;
 
-	int need_update, need_redraw;
-	struct sigaction old_sigwinch, old_sigalrm;
+	long changed;        /* ms, time of the last SIGWINCH or 0 */
+	int handled;
+	struct sigaction old_sigwinch;
 } rl_window;
 
-static void rl_update_window();
-
 /* -------------------------------------------------------------------------- */
-static void sig_alarm(int sig)
+static void sig_winch(int sig)
 {
+	rl_notify_send("w");
 }
+
 /* -------------------------------------------------------------------------- */
-static void sig_winch(int sig)
+static void rl_window_changed()
 {
-	rl_window.need_update = 1;
-	static const struct itimerval itmr = {
-		.it_interval = { .tv_sec = 0, .tv_usec = 0 },
-		.it_value = { .tv_sec = 0, .tv_usec = 100000 }
-	};
-	setitimer(ITIMER_REAL, &itmr, NULL);
+	rl_window.changed = rl_now();
 }
 
 /* -------------------------------------------------------------------------- */
-static inline int rl_window_check()
+/* ms to wait before the window size is settled or -1 if it was not changed */
+static int rl_window_timeout()
 {
-	return rl_window.need_update;
+	if (!rl_window.changed || rl_state->remote)
+		return -1; /* the process terminal is resized, not this one */
+
+	long left = rl_window.changed + RL_RESIZE_DELAY - rl_now();
+	return left > 0 ? left : 0;
 }
 
 /* -------------------------------------------------------------------------- */
-static void rl_window_update()
+static int rl_window_size()
 {
 	struct winsize ws;
-	if (rl_window.need_update) {
-		rl_window.need_update = 0;
-		rl_window.cols = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) ?
-			RL_WINDOW_WIDTH : ws.ws_col;
-	}
+	if (rl_state->remote)
+		return rl_window.cols;
+	rl_window.changed = 0;
+#ifdef RL_TRACE
+	if (rl_trace.replay)
+		return rl_trace.cols;
+#endif
+	return (ioctl(RL_OUT, TIOCGWINSZ, &ws) == -1) ?
+		RL_WINDOW_WIDTH : ws.ws_col;
 }
 
 typedef
@@ -193,19 +584,17 @@ static int rl_signal(int sig, int flags, sig_handler_t *handler, struct sigactio
 /* -------------------------------------------------------------------------- */
 static void rl_window_init()
 {
-	rl_window.need_update = 1;
-	rl_window_update();
-	rl_signal(SIGWINCH, SA_RESTART, sig_winch, &rl_window.old_sigwinch);
-	rl_signal(SIGALRM, 0, sig_alarm, &rl_window.old_sigalrm);
+	rl_window.cols = rl_window_size();
+	if (!rl_window.handled)
+		rl_window.handled = !rl_signal(SIGWINCH, SA_RESTART, sig_winch, &rl_window.old_sigwinch);
 }
 
 /* -------------------------------------------------------------------------- */
 static void rl_window_free()
 {
-	if (rl_window.old_sigwinch.sa_handler)
+	if (rl_window.handled)
 		rl_signal(SIGWINCH, 0, NULL, &rl_window.old_sigwinch);
-	if (rl_window.old_sigalrm.sa_handler)
-		rl_signal(SIGALRM, 0, NULL, &rl_window.old_sigalrm);
+	rl_window.handled = 0;
 }
 #else
 static struct {
@@ -213,21 +602,35 @@ static struct {
 } rl_window = { 80 };
 
 /* -------------------------------------------------------------------------- */
-static inline  int rl_window_check(){ return 0; }
-static inline void rl_window_update() {}
-static inline void rl_window_init()  {}
-static inline void rl_window_free()  {}
+static inline void rl_window_changed() {}
+static inline  int rl_window_timeout() { return -1; }
+static inline  int rl_window_size()    { return rl_window.cols; }
+static inline void rl_window_init()    {}
+static inline void rl_window_free()    {}
 #endif
 
+/* -------------------------------------------------------------------------- */
+static void rl_notified()
+{
+	char buf[32];
+	int count;
+	while ((count = read(rl_notify[0], buf, sizeof(buf))) > 0)
+		if (memchr(buf, 'w', count))
+			rl_window_changed();
+	rl_prompt_update(); /* 'p' may be lost in a full pipe */
+}
+
 /* -------------------------------------------------------------------------- */
 static int atexit_ok = 0;
 static int in_raw = 0;
+static int in_line;  /* the mode set, when in_raw */
+static int paused;   /* by readline_pause(), the keys typed since are kept */
 static struct termios term_old;
 
 /* -------------------------------------------------------------------------- */
 STATIC int rl_term_unraw()
 {
-	if (!in_raw)
+	if (!in_raw || (rl_state && rl_state->remote))
 		return 0;
 
 	return in_raw = tcsetattr(STDOUT_FILENO, TCSAFLUSH, &term_old);
@@ -240,109 +643,242 @@ STATIC void rl_atexit()
 }
 
 /* -------------------------------------------------------------------------- */
-STATIC int rl_term_raw()
+STATIC int rl_term_mode(int line)
 {
+#ifdef RL_TRACE
+	if (rl_trace.replay)
+		return 0; /* the editor works as on a terminal of the trace */
+#endif
+	if (rl_state->remote)
+		return -1; /* the remote side sets its terminal up */
 	if (!atexit_ok)
 		atexit_ok = !atexit(rl_atexit);
-	if (tcgetattr(STDOUT_FILENO, &term_old) < 0)
+	if (in_raw && in_line == line)
+		return 0; /* kept from the last line */
+	if (!in_raw && tcgetattr(STDOUT_FILENO, &term_old) < 0)
 		return -1;
 
 	struct termios my = term_old;
-	my.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON); //~(ICRNL | INPCK | ISTRIP | IXON);
-	my.c_iflag |=  (IGNBRK);
-	my.c_oflag &= ~(OPOST);
-	my.c_cflag |=  (CS8);
-	my.c_lflag &= ~(ECHO | ICANON | IEXTEN); // | ISIG);
-	my.c_cc[VMIN] = 1;
-	my.c_cc[VTIME] = 0;
-
-	if (tcsetattr(STDOUT_FILENO, TCSAFLUSH, &my) < 0)
+	if (line) {
+		/* The terminal edits and echoes the line itself. A telnet server
+		   switches its client into LINEMODE when it sees the pty canonical.
+		   Tab and Esc (arrows) finish the line like Enter does, then we go
+		   on in character mode. */
+		my.c_iflag |=  (ICRNL);
+		my.c_lflag |=  (ECHO | ECHOE | ECHOK | ICANON);
+		my.c_cc[VEOL] = '\t';
+		my.c_cc[VEOL2] = '\033';
+	} else {
+		my.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON); //~(ICRNL | INPCK | ISTRIP | IXON);
+		my.c_iflag |=  (IGNBRK);
+		if (!rl_state->keep_raw) /* else the application prints between lines */
+			my.c_oflag &= ~(OPOST);
+		my.c_cflag |=  (CS8);
+		my.c_lflag &= ~(ECHO | ICANON | IEXTEN); // | ISIG);
+		my.c_cc[VMIN] = 1;
+		my.c_cc[VTIME] = 0;
+	}
+
+	/* switching between own modes or back from a pause must keep the typed
+	   ahead input */
+	int keep = in_raw || paused || rl_state->keep_raw;
+	if (tcsetattr(STDOUT_FILENO, keep ? TCSANOW : TCSAFLUSH, &my) < 0)
 		return -1;
 
+	paused = 0;
+
+	in_line = line;
 	return in_raw = 1, 0;
 }
 
-/* ------------------------------------<------------------------------------- */
-STATIC void safe_write(int fd, char const *data, int size)
+/* -------------------------------------------------------------------------- */
+STATIC int rl_term_raw()
 {
-	if (!size)
-		return;
-
-	int ret;
-_next_part:
-	do {
-		ret = write(fd, data, size);
-	} while (ret < 0 && errno == EINTR);
+	return rl_term_mode(0);
+}
 
-	if (ret < 0) {
-		syslog(LOG_DEBUG, "readline write: %m");
-		exit(1);
-	}
-	if (ret < size) {
-		data += ret;
-		size -= ret;
-		goto _next_part;
+/* ------------------------------------<------------------------------------- */
+/* Writes what the fd takes now. Returns count of bytes written, less than
+   `size` when a non-blocking fd is full, or -1 on error. A closed socket is
+   an error, not SIGPIPE. */
+STATIC int safe_write(int fd, char const *data, int size, int sock)
+{
+	int done = 0;
+	while (done < size) {
+		int ret = sock ?
+			send(fd, data + done, size - done, MSG_NOSIGNAL) :
+			write(fd, data + done, size - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			syslog(LOG_DEBUG, "readline write: %m");
+			return -1;
+		}
+		STAT_ADD(writes, 1);
+		STAT_ADD(bytes_written, ret);
+		done += ret;
 	}
+	return done;
 }
 
 /* ------------------------------------<------------------------------------- */
+/* Returns count of bytes read, 0 at EOF or on error, -1 when a non-blocking
+   fd has nothing */
 STATIC int safe_read(int fd, char *data, int size)
 {
 	int ret;
 	do {
 		ret = read(fd, data, size);
-		if (ret >= 0 || errno != EINTR)
-			break;
-		rl_update_window();
-	} while (1);
+	} while (ret < 0 && errno == EINTR);
 
 	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -1;
 		syslog(LOG_DEBUG, "readline read: %m");
-		exit(1);
+		return 0;
 	}
+	STAT_ADD(reads, 1);
+	STAT_ADD(bytes_read, ret);
 	return ret;
 }
 
 #ifdef RL_USE_WRITE
 /* -------------------------------------------------------------------------- */
-static struct {
-	unsigned char data[4096];
-	int top;
-} rl_output;
+/* Output queue: bytes from `pos` to `top` wait for the terminal. A blocking
+   stdout takes them all at once; a non-blocking one keeps the rest queued up
+   to RL_OUTPUT_MAX bytes, then the terminal is given up as broken. */
+typedef
+struct rl_output {
+	char *data;
+	int size, pos, top;
+	int sock;      /* stdout is a socket, -1 -- not known yet */
+	int error;     /* output failed, nothing is written any more */
+} rl_output_t;
+
+static rl_output_t rl_output = { .sock = -1 };
+
+#define RL_OUTPUT_CHUNK 4096
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_out_fail()
+{
+	rl_output.error = 1;
+	rl_output.pos = rl_output.top = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC int rl_out_write(char const *data, int size)
+{
+	if (rl_output.sock < 0) {
+		struct stat st;
+		rl_output.sock = !fstat(RL_OUT, &st) && S_ISSOCK(st.st_mode);
+	}
+	int ret = safe_write(RL_OUT, data, size, rl_output.sock);
+	if (ret < 0)
+		rl_out_fail();
+	return ret < 0 ? size : ret;
+}
 
 /* -------------------------------------------------------------------------- */
 void rl_out_purge()
 {
-	if (!rl_output.top)
+	if (rl_output.pos == rl_output.top)
 		return;
 
-	safe_write(STDOUT_FILENO, rl_output.data, rl_output.top);
-	rl_output.top = 0;
+	STAT_ADD(flushes, 1);
+	rl_output.pos += rl_out_write(rl_output.data + rl_output.pos, rl_output.top - rl_output.pos);
+	if (rl_output.pos >= rl_output.top)
+		rl_output.pos = rl_output.top = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Makes room for `size` more bytes in the queue */
+STATIC int rl_out_room(int size)
+{
+	int pending = rl_output.top - rl_output.pos;
+	if (pending + size > RL_OUTPUT_MAX)
+		return -1;
+	if (rl_output.top + size <= rl_output.size)
+		return 0;
+
+	memmove(rl_output.data, rl_output.data + rl_output.pos, pending);
+	rl_output.pos = 0;
+	rl_output.top = pending;
+	if (pending + size <= rl_output.size)
+		return 0;
+
+	int new_size = rl_output.size ? rl_output.size : RL_OUTPUT_CHUNK;
+	while (new_size < pending + size)
+		new_size *= 2;
+	char *data = rl_realloc(rl_output.data, new_size);
+	if (!data)
+		return -1;
+	rl_output.data = data;
+	rl_output.size = new_size;
+	return 0;
 }
 
 /* -------------------------------------------------------------------------- */
 void rl_out(char const *data, int size)
 {
-	if (rl_output.top && (rl_output.top + size) > sizeof(rl_output.data)) {
-		unsigned int dsize = sizeof(rl_output.data) - rl_output.top;
-		memcpy(rl_output.data + rl_output.top, data, dsize);
-		data += dsize;
-		size -= dsize;
-		rl_output.top += dsize;
+	if (rl_output.error)
+		return;
+
+	if (rl_output.top - rl_output.pos + size > RL_OUTPUT_CHUNK)
 		rl_out_purge();
-	}
 
-	if (!rl_output.top)
-		while (size > sizeof(rl_output.data)) {
-			safe_write(STDOUT_FILENO, data, sizeof(rl_output.data));
-			size -= sizeof(rl_output.data);
-			data += sizeof(rl_output.data);
-		}
+	if (rl_output.pos == rl_output.top && size > RL_OUTPUT_CHUNK) {
+		int ret = rl_out_write(data, size); /* big, no copy */
+		data += ret;
+		size -= ret;
+	}
+	if (!size || rl_output.error)
+		return;
 
+	if (rl_out_room(size) < 0) {
+		syslog(LOG_DEBUG, "readline: the terminal does not take output");
+		rl_out_fail();
+		return;
+	}
 	memcpy(rl_output.data + rl_output.top, data, size);
 	rl_output.top += size;
 }
 
+/* -------------------------------------------------------------------------- */
+static inline int rl_out_pending()
+{
+	return rl_output.top - rl_output.pos;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Waits until the terminal takes all the queued output */
+STATIC void rl_out_drain()
+{
+	for (rl_out_purge(); rl_out_pending(); rl_out_purge()) {
+		struct pollfd pfd = { .fd = RL_OUT, .events = POLLOUT };
+		poll(&pfd, 1, -1);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_out_init()
+{
+	rl_output.sock = -1; /* stdout may be another file now */
+	rl_output.error = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_out_free()
+{
+	rl_out_drain();
+	if (rl_output.data)
+		rl_free(rl_output.data);
+	memset(&rl_output, 0, sizeof(rl_output));
+	rl_output.sock = -1;
+}
+
 /* ------------------------------------<------------------------------------- */
 void rl_printf(char const *fmt, ...)
 {
@@ -376,19 +912,28 @@ static inline rl_glyph_t utf8_to_glyph(char const **utf8)
 					raw += 3;
 				} else
 					return 0;
-			}
+			} else
+				if ((*raw & 0xF8) == 0xF0) {
+					if ((raw[1] & 0300) == 0200 && (raw[2] & 0300) == 0200 && (raw[3] & 0300) == 0200) {
+						glyph = ((raw[0] & 0x7) << 18) + ((raw[1] & 0x3F) << 12) + ((raw[2] & 0x3F) << 6) + (raw[3] & 0x3F);
+						raw += 4;
+					} else
+						return 0;
+				} else
+					return 0;
 	*utf8 = raw;
 	return glyph;
 }
 
 /* ------------------------------------<------------------------------------- */
-STATIC rl_glyph_t *utf8tog(rl_glyph_t *glyphs, char const *raw)
+STATIC rl_glyph_t *utf8tog(rl_glyph_t *glyphs, char const *raw, int count)
 {
-	while (*raw) {
+	while (*raw && count) {
 		rl_glyph_t gl = utf8_to_glyph(&raw);
-		if (gl)
+		if (gl) {
 			*glyphs++ = gl;
-		else
+			--count;
+		} else
 			++raw; /* skip a char of wrong utf8 sequence */
 	}
 
@@ -397,16 +942,70 @@ STATIC rl_glyph_t *utf8tog(rl_glyph_t *glyphs, char const *raw)
 }
 
 /* -------------------------------------------------------------------------- */
+static inline int glyph_width(rl_glyph_t gl)
+{
+	if (gl < RL_WIDTH_LIMIT) {
+		unsigned int pos = gl % RL_WIDTH_BLOCK;
+		return 3 & rl_width_blocks[rl_width_index[gl / RL_WIDTH_BLOCK]][pos / 4] >> (pos % 4 * 2);
+	}
+
+	if (gl < 0x40000)
+		return 2; /* CJK planes */
+	if (0xE0000 <= gl && gl < 0xE1000)
+		return 0; /* tags and variation selectors */
+	return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Length of the escape sequence at `raw` */
+static int esc_length(char const *raw)
+{
+	char const *at = raw + 1;
+	if (*at == '[') /* CSI ... final */
+		for (++at; *at && !(64 <= *at && *at <= 126); ++at);
+	else
+		if (*at == ']') /* OSC ... BEL or ST */
+			for (++at; *at && *at != '\007' && !(at[0] == '\033' && at[1] == '\\'); ++at);
+	if (*at == '\033')
+		++at;
+	if (*at)
+		++at;
+	return at - raw;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Screen width of a text: escape sequences take no place, only the last line
+   of a multiline text is measured */
 STATIC int utf8_width(char const *raw)
 {
-	int count = 0;
+	int width = 0;
 	while (*raw) {
-		if (!utf8_to_glyph(&raw))
+		if (*raw == '\033') {
+			raw += esc_length(raw);
+			continue;
+		}
+
+		if (*raw == '\n' || *raw == '\r') {
+			++raw;
+			width = 0;
+			continue;
+		}
+
+		rl_glyph_t gl = utf8_to_glyph(&raw);
+		if (gl)
+			width += glyph_width(gl);
+		else
 			++raw; /* skip a char of wrong utf8 sequence */
-		++count;
 	}
 
-	return count;
+	return width;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Zero width glyph drawn over the previous one, a line break is not */
+static inline int glyph_mark(rl_glyph_t gl)
+{
+	return !glyph_width(gl) && gl != '\n';
 }
 
 /* ----------------------------<--------------------------------------------- */
@@ -414,80 +1013,347 @@ STATIC char *gtoutf8(char *raw, rl_glyph_t const *glyphs, int count)
 {
 	while (*glyphs && count--) {
 		unsigned int uc = *glyphs++;
-		if (!(uc & 0xFF80))
+		if (uc < 0x80)
 			*raw++ = uc;
 		else
-			if (!(uc & 0xF800)) {
+			if (uc < 0x800) {
 				*raw++ = 0xC0 | (uc >> 6);
 				*raw++ = 0x80 | (uc & 0x3F);
-			} else {
-				*raw++ = 0xE0 | (uc >> 12);
-				*raw++ = 0x80 | (0x3F & uc >> 6);
-				*raw++ = 0x80 | (0x3F & uc);
-			}
+			} else
+				if (uc < 0x10000) {
+					*raw++ = 0xE0 | (uc >> 12);
+					*raw++ = 0x80 | (0x3F & uc >> 6);
+					*raw++ = 0x80 | (0x3F & uc);
+				} else {
+					*raw++ = 0xF0 | (uc >> 18);
+					*raw++ = 0x80 | (0x3F & uc >> 12);
+					*raw++ = 0x80 | (0x3F & uc >> 6);
+					*raw++ = 0x80 | (0x3F & uc);
+				}
 	}
 	*raw = 0;
 	return raw;
 }
 
 /* -------------------------------------------------------------------------- */
-STATIC int skip_char_seq(char const *start)
-{
-	char const *raw = start;
-	rl_glyph_t glyph = utf8_to_glyph(&raw);
-	if (glyph != '\033')
-		return raw - start;
-
-	unsigned char ch = *raw++;
-	switch (ch) {
-	case '[':
-	case 'O':
-		while (isdigit(*raw) || *raw == ';')
-			++raw;
-		ch = *raw++;
-		if (64 <= ch && ch <= 126)
-			return raw - start;
-		return 0;
+/* Input tokenizer: splits input into utf-8 chars, ESC-prefixed keys and
+   control sequences. Every byte is looked at once; sequences the editor
+   does not know (OSC, DCS, mouse and focus reports) are passed through to
+   be ignored, broken ones are dropped. */
 
-	default:
-		if (32 <= ch && ch <= 127)
-			return raw + 1 - start;
-	}
-
-	return 0; /* not closed sequence */
-}
+enum {
+	TK_GROUND, TK_UTF8, TK_ESC, TK_CSI, TK_SS3, TK_STR, TK_STR_ESC, TK_MOUSE
+};
+
+/* -------------------------------------------------------------------------- */
+static inline void tok_add(rl_tok_t *tok, int ch)
+{
+	if (tok->length < sizeof(tok->seq) - 1)
+		tok->seq[tok->length++] = ch;
+	else
+		tok->broken = 1; /* too long to be a key */
+}
+
+/* -------------------------------------------------------------------------- */
+static inline char const *tok_done(rl_tok_t *tok)
+{
+	int broken = tok->broken;
+	tok->seq[tok->length] = 0;
+	tok->state = TK_GROUND;
+	tok->length = tok->broken = 0;
+	return broken ? NULL : tok->seq;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Returns a finished token or NULL. *ch is set to -1 when the byte is taken,
+   else it starts a new token and has to be fed again. */
+STATIC char const *rl_tok_feed(int *ch)
+{
+	rl_tok_t *tok = &rl_state->tok;
+	int c = *ch;
+	*ch = -1;
+
+	switch (tok->state) {
+	case TK_GROUND:
+		tok->length = 0;
+		tok_add(tok, c);
+		if (c == '\033') {
+			tok->state = TK_ESC;
+			return NULL;
+		}
+		if (c < 0x80)
+			return tok_done(tok);
+		if (c < 0xC0 || c >= 0xF8) {
+			tok->length = 0; /* not a lead byte */
+			return NULL;
+		}
+		tok->need = c < 0xE0 ? 1 : c < 0xF0 ? 2 : 3;
+		tok->state = TK_UTF8;
+		return NULL;
+
+	case TK_UTF8:
+		if ((c & 0xC0) != 0x80)
+			break; /* cut char */
+		tok_add(tok, c);
+		return --tok->need ? NULL : tok_done(tok);
+
+	case TK_ESC:
+		tok_add(tok, c);
+		switch (c) {
+		case '[': tok->state = TK_CSI; return NULL;
+		case 'O': tok->state = TK_SS3; return NULL;
+		case ']': case 'P': case '_': case '^': case 'X':
+			tok->state = TK_STR; /* OSC, DCS, APC, PM, SOS */
+			tok->broken = 1;
+			return NULL;
+		}
+		if (c < 0x80 && c != '\033')
+			return tok_done(tok); /* Alt + key */
+		--tok->length;
+		*ch = c;
+		return tok_done(tok); /* lone Esc */
+
+	case TK_CSI:
+		if (0x20 <= c && c <= 0x3F) { /* parameters and intermediates */
+			tok_add(tok, c);
+			return NULL;
+		}
+		if (0x40 <= c && c <= 0x7E) {
+			tok_add(tok, c);
+			if (c == 'M' && tok->length == 3) { /* X10 mouse report */
+				tok->state = TK_MOUSE;
+				tok->need = 3;
+				tok->broken = 1;
+				return NULL;
+			}
+			return tok_done(tok);
+		}
+		break;
+
+	case TK_SS3:
+		tok_add(tok, c);
+		if (0x40 <= c && c <= 0x7E)
+			return tok_done(tok);
+		if (0x30 <= c && c <= 0x3F)
+			return NULL; /* modifiers */
+		tok->broken = 1;
+		return tok_done(tok);
+
+	case TK_MOUSE:
+		if (!--tok->need)
+			tok_done(tok);
+		return NULL;
+
+	case TK_STR:
+		if (c == '\007')
+			tok_done(tok);
+		else
+			if (c == '\033')
+				tok->state = TK_STR_ESC;
+			else
+				if (c == 0x18 || c == 0x1A)
+					tok_done(tok); /* CAN, SUB */
+		return NULL;
+
+	case TK_STR_ESC:
+		if (c == '\\') {
+			tok_done(tok);
+			return NULL;
+		}
+		tok->length = tok->broken = 0; /* not ST, Esc starts a new sequence */
+		tok_add(tok, '\033');
+		tok->state = TK_ESC;
+		*ch = c;
+		return NULL;
+	}
+
+	/* the sequence is broken by the byte, it starts a new one */
+	tok->broken = 1;
+	tok_done(tok);
+	*ch = c;
+	return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+/* No more input came in time: Esc alone is a key, parts of sequences are
+   dropped */
+STATIC char const *rl_tok_flush()
+{
+	rl_tok_t *tok = &rl_state->tok;
+	if (tok->state == TK_GROUND)
+		return NULL;
+
+	if (tok->state != TK_ESC)
+		tok->broken = 1;
+	return tok_done(tok);
+}
 
 /* -------------------------------------------------------------------------- */
 STATIC void rl_write(char const *code, int count)
 {
 	char buf[RL_MAX_LENGTH*2], *to = buf;
-	while (count--)
+	int length = strlen(code);
+	while (count--) {
+		if (to + length > buf + sizeof(buf)) {
+			rl_out(buf, to-buf);
+			to = buf;
+		}
 		to = stpcpy(to, code);
+	}
 	rl_out(buf, to-buf);
 }
 
 /* -------------------------------------------------------------------------- */
-STATIC void rl_move(int count)
+/* Column behind the line break at glyph `pos`: the start of the next row, or
+   the same column when the text before has just filled its row up. Without
+   known width the break is shown as a space. */
+static int rl_break_col(int col, int pos)
+{
+	int cols = rl_window.cols;
+	if (!cols)
+		return col + 1;
+	if (col && !(col % cols) && (!pos || rl_state->line[pos - 1] != '\n'))
+		return col;
+	return (col / cols + 1) * cols;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Screen column in front of glyph `pos`, counted from the prompt start; row
+   is column / window width. Columns are summed up lazily from the first glyph
+   changed since the last call. */
+STATIC int rl_col(int pos)
+{
+	rl_state_t *s = rl_state;
+	if (!s->cols_valid) {
+		s->col[0] = s->prompt_width;
+		s->cols_valid = 1;
+	}
+
+	int cols = rl_window.cols;
+	while (s->cols_valid <= pos) {
+		int i = s->cols_valid - 1;
+		int col = s->col[i], width = glyph_width(s->line[i]);
+		if (s->line[i] == '\n')
+			col = rl_break_col(col, i);
+		else {
+			if (width > 1 && cols > 1 && col % cols == cols - 1)
+				++col; /* wide glyph does not fit into the last column */
+			col += width;
+		}
+		s->col[s->cols_valid++] = col;
+	}
+	return s->col[pos];
+}
+
+/* -------------------------------------------------------------------------- */
+/* Whether the cursor stays on the last column after glyphs [from, to) were
+   written, while the column arithmetic puts it on the next row */
+static int rl_wrap_pending(int from, int to)
+{
+	int end = rl_col(to);
+	if (!rl_window.cols || end == rl_col(from) || end % rl_window.cols)
+		return 0;
+	return rl_state->line[to - 1] != '\n' || end == rl_col(to - 1);
+}
+
+/* -------------------------------------------------------------------------- */
+static inline void rl_cols_dirty(int pos)
+{
+	if (rl_state->cols_valid > pos + 1)
+		rl_state->cols_valid = pos + 1;
+}
+
+/* -------------------------------------------------------------------------- */
+/* The first glyph at or behind the screen column */
+STATIC int rl_col_pos(int col)
+{
+	int lo = 0, hi = rl_state->length;
+	rl_col(hi);
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (rl_state->col[mid] < col)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* -------------------------------------------------------------------------- */
+#define RL_GHOST_STYLE  255  /* of suggested text after the line */
+
+/* -------------------------------------------------------------------------- */
+/* SGR sequence switching the terminal to the style, returns its end */
+static char *rl_sgr(char *to, int style)
+{
+	rl_state->sgr = style;
+	if (style == RL_GHOST_STYLE)
+		return stpcpy(to, "\033[0;2m"); /* dim */
+	if (!style || style > rl_state->styles_count)
+		return stpcpy(to, "\033[m");
+	to += sprintf(to, "\033[0;%.32sm", rl_state->styles[style - 1]);
+	return to;
+}
+
+/* -------------------------------------------------------------------------- */
+static void rl_sgr_reset()
+{
+	char buf[8];
+	if (rl_state->sgr)
+		rl_out(buf, rl_sgr(buf, 0) - buf);
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_write_part(int start, int length)
+{
+	char buf[RL_MAX_LENGTH*5], *to = buf;
+	rl_state_t *s = rl_state;
+	rl_glyph_t const *line = s->line;
+	for (int pos = start, end = start + length; pos < end; ++pos) {
+		if (to > buf + sizeof(buf) - 64) {
+			rl_out(buf, to-buf);
+			to = buf;
+		}
+		if (line[pos] == '\n') {
+			if (!rl_window.cols)
+				*to++ = ' ';
+			else
+				if (rl_col(pos + 1) != rl_col(pos)) {
+					if (s->sgr)
+						to = rl_sgr(to, 0);
+					to = stpcpy(to, CLEAR_EOL "\r\n");
+				}
+			continue;
+		}
+		if (rl_col(pos + 1) - rl_col(pos) > glyph_width(line[pos]))
+			*to++ = ' '; /* pad the last column before a wide glyph */
+		if (s->attr[pos] != s->sgr)
+			to = rl_sgr(to, s->attr[pos]);
+		to = gtoutf8(to, line + pos, 1);
+	}
+	if (to != buf)
+		rl_out(buf, to-buf);
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_move(int from, int to)
 {
 	if (!rl_window.cols) {
-		if (count < 0)
-			rl_write(CUR_LEFT, -count);
+		if (to < from)
+			rl_write(CUR_LEFT, from - to);
 		else
-			if (count > 0) {
-				char buf[RL_MAX_LENGTH * 3];
-				char *to = gtoutf8(buf, rl_state->line + rl_state->cur_pos, count);
-				if (to != buf)
-					rl_out(buf, to - buf);
+			if (to > from) {
+				int start = rl_col_pos(from);
+				rl_write_part(start, rl_col_pos(to) - start);
+				rl_sgr_reset();
 			}
 		return;
 	}
 
-	int pos = rl_state->cur_pos + rl_state->prompt_width;
-	int row = pos / rl_window.cols;
-	int col = pos % rl_window.cols;
-	pos += count;
-	int torow = pos / rl_window.cols;
-	int tocol = pos % rl_window.cols;
+	int row = from / rl_window.cols;
+	int col = from % rl_window.cols;
+	int torow = to / rl_window.cols;
+	int tocol = to % rl_window.cols;
 
 	if (tocol < col)
 		rl_printf(CUR_LEFT_N, col - tocol);
@@ -503,69 +1369,412 @@ STATIC void rl_move(int count)
 }
 
 /* -------------------------------------------------------------------------- */
-STATIC void rl_update_tail(int afterspace)
+/* Glyphs [pos, pos + count) were inserted (count > 0) or deleted (count < 0)
+   and are to be highlighted again */
+STATIC void rl_highlight_dirty(int pos, int count)
 {
-	int c = afterspace;
-	char buf[RL_MAX_LENGTH * 3];
-	char *to = gtoutf8(buf, rl_state->line + rl_state->cur_pos, -1);
-	while (c--)
-		*to++ = ' ';
-	*to = 0;
-	if (to != buf)
-		rl_out(buf, to-buf);
-	c = afterspace + rl_state->length - rl_state->cur_pos;
-	if (c > 0) {
-		rl_state->cur_pos += c;
-		rl_move(-c);
-		rl_state->cur_pos -= c;
+	rl_state_t *s = rl_state;
+	int *end[2] = { &s->hl_from, &s->hl_to };
+	if (s->hl_from <= s->hl_to)
+		for (int i = 0; i < 2; ++i)
+			if (*end[i] > pos)
+				*end[i] = count > 0 ? *end[i] + count :
+					*end[i] + count > pos ? *end[i] + count : pos;
+
+	int to = count > 0 ? pos + count : pos;
+	if (s->hl_from > s->hl_to) {
+		s->hl_from = pos;
+		s->hl_to = to;
+		return;
 	}
+	if (s->hl_from > pos)
+		s->hl_from = pos;
+	if (s->hl_to < to)
+		s->hl_to = to;
 }
 
 /* -------------------------------------------------------------------------- */
-STATIC void rl_write_part(int start, int length)
+/* Asks the highlight function to style the changed glyphs. It gets the byte
+   range of them and may return spans reaching out of it; the glyphs of the
+   range not covered by spans get the default style. */
+STATIC void rl_highlight()
 {
-	char buf[RL_MAX_LENGTH*2];
-	char *to = gtoutf8(buf, rl_state->line + start, length);
-	if (to != buf)
-		rl_out(buf, to-buf);
+	rl_state_t *s = rl_state;
+	int from = s->hl_from, to = s->hl_to, length = s->length;
+	if (!s->_highlight || from > to)
+		return;
+
+	s->hl_from = 1;
+	s->hl_to = 0;
+	if (to > length)
+		to = length;
+	if (from > to)
+		from = to;
+
+	int offset[RL_MAX_LENGTH + 1];
+	char *raw = s->raw, *end = raw;
+	for (int pos = 0; pos < length; ++pos) {
+		offset[pos] = end - raw;
+		end = gtoutf8(end, s->line + pos, 1);
+	}
+	offset[length] = end - raw;
+	*end = 0;
+
+	rl_span_t spans[64];
+	int count = s->_highlight(raw, offset[from], offset[to], spans, countof(spans));
+
+	memset(s->attr + from, 0, to - from);
+	for (rl_span_t *span = spans; span < spans + count && span < spans + countof(spans); ++span) {
+		int pos[2] = { span->start, span->end };
+		for (int i = 0; i < 2; ++i) { /* the first glyph at or after the byte */
+			int lo = 0, hi = length;
+			while (lo < hi) {
+				int mid = (lo + hi) / 2;
+				if (offset[mid] < pos[i])
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			pos[i] = lo;
+		}
+		if (pos[1] > pos[0])
+			memset(s->attr + pos[0], span->style > 0 && span->style < RL_GHOST_STYLE ? span->style : 0, pos[1] - pos[0]);
+	}
+	if (s->drawn && memcmp(s->attr, s->shown_attr, length))
+		s->drawn = 0;
 }
 
+
 /* -------------------------------------------------------------------------- */
-STATIC void rl_redraw(int inplace, int tail)
+/* Suggested end of the line when the cursor is at its end, NULL if none */
+STATIC char const *rl_suggestion()
 {
-	if (inplace)
-		rl_move(-(rl_state->cur_pos + rl_state->prompt_width));
+	rl_state_t *s = rl_state;
+	if (!s->history.trie || !s->length || s->cur_pos != s->length || s->finish)
+		return NULL;
 
-	rl_out(rl_state->prompt, strlen(rl_state->prompt));
-	rl_write_part(0, rl_state->cur_pos);
-	rl_update_tail(tail);
+	char prefix[sizeof(s->raw)];
+	char *end = gtoutf8(prefix, s->line, s->length);
+	return history_suggest(prefix, end - prefix);
 }
 
 /* -------------------------------------------------------------------------- */
-STATIC void rlc_cursor_home()
+/* Puts the suggestion behind the line for rendering, it is rendered like any
+   text: when a typed char matches it, only the char's style is changed on
+   the screen. Returns the line length to restore. */
+STATIC int rl_ghost()
 {
-	rl_move(-rl_state->cur_pos);
-	rl_state->cur_pos = 0;
+	rl_state_t *s = rl_state;
+	int length = s->length;
+	char const *ghost = s->ghost_hidden ? NULL : rl_suggestion();
+	if (!ghost)
+		return length;
+
+	rl_glyph_t *end = utf8tog(s->line + length, ghost, countof(s->line) - length - 1);
+	memset(s->attr + length, RL_GHOST_STYLE, end - (s->line + length));
+	s->length = end - s->line;
+	s->drawn = 0;
+	return length;
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_render_line();
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_render()
+{
+	rl_highlight();
+
+	rl_state_t *s = rl_state;
+	int length = rl_ghost();
+	rl_render_line();
+	if (s->length != length) {
+		s->length = length;
+		s->line[length] = 0;
+		s->drawn = 0; /* the suggestion is on the screen */
+		rl_cols_dirty(length);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* Handlers only change the line; the screen catches up here, once per frame:
+   everything after the first changed glyph is rewritten and the rest of the
+   old text is blanked. The tail which is the same as shown and starts at the
+   same column is kept: after a char was replaced, or behind the line break
+   closing the edited row. */
+STATIC void rl_render_line()
+{
+	rl_state_t *s = rl_state;
+	int length = s->length, shown = s->shown_length;
+	int same = length < shown ? length : shown, diff = s->drawn ? same : 0;
+
+	while (diff < same && s->line[diff] == s->shown[diff] && s->attr[diff] == s->shown_attr[diff])
+		++diff;
+
+	int end = rl_col(length);
+	if (diff == length && diff == shown && end == s->shown_end) {
+		int to = rl_col(s->cur_pos);
+		if (s->shown_col != to) {
+			rl_move(s->shown_col, to);
+			STAT_ADD(cursor_moves, 1);
+		}
+		s->shown_col = to;
+		return;
+	}
+
+	if (shown)
+		STAT_ADD(partial_redraws, 1);
+	else
+		STAT_ADD(full_redraws, 1);
+
+	int last = length, old = shown;
+	while (last > diff && old > diff && s->line[last - 1] == s->shown[old - 1] &&
+			s->attr[last - 1] == s->shown_attr[old - 1])
+		--last, --old;
+	while (last < length && (rl_col(last) != s->shown_cols[old] ||
+			rl_col(last + 1) != s->shown_cols[old + 1]))
+		++last, ++old;
+
+	int start = rl_col(diff), pending;
+	rl_move(s->shown_col, start);
+	if (last < length) { /* the tail is in place */
+		rl_write_part(diff, last - diff);
+		rl_sgr_reset();
+		pending = rl_wrap_pending(diff, last);
+		end = rl_col(last);
+	} else {
+		rl_write_part(diff, length - diff);
+		rl_sgr_reset();
+		pending = rl_wrap_pending(diff, length);
+
+		if (s->shown_end > end) {
+			rl_write(" ", s->shown_end - end);
+			end = s->shown_end;
+			pending = rl_window.cols && !(end % rl_window.cols);
+		}
+	}
+
+	/* the cursor stays on the last column after it is written, move it to
+	   the next row where our arithmetic expects it */
+	if (pending)
+		rl_out("\r\n", 2);
+
+	memcpy(s->shown + diff, s->line + diff, (length - diff) * sizeof(s->line[0]));
+	memcpy(s->shown_attr + diff, s->attr + diff, length - diff);
+	memcpy(s->shown_cols + diff, s->col + diff, (length - diff + 1) * sizeof(s->col[0]));
+	s->shown_length = length;
+	s->shown_end = rl_col(length);
+	s->drawn = 1;
+
+	int to = rl_col(s->cur_pos);
+	rl_move(end, to);
+	s->shown_col = to;
+}
+
+/* -------------------------------------------------------------------------- */
+/* The prompt has just been printed and `dirty` cells after it hold unknown
+   content: the next render rewrites the whole line and blanks them. */
+STATIC void rl_invalidate(int dirty)
+{
+	rl_state_t *s = rl_state;
+	s->cols_valid = 0;
+	s->shown_length = s->drawn = 0;
+	s->shown_col = rl_col(0);
+	s->shown_end = s->shown_col + dirty;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Moves the cursor behind the line as it is on the screen */
+STATIC void rl_render_end()
+{
+	rl_state->ghost_hidden = 1;
+	rl_render();
+	rl_state->ghost_hidden = 0;
+	rl_move(rl_state->shown_col, rl_state->shown_end);
+	rl_state->shown_col = rl_state->shown_end;
+}
+
+/* -------------------------------------------------------------------------- */
+enum { RL_UNDO_INSERT, RL_UNDO_DELETE };
+
+#define RL_UNDO_TYPED  1  /* typed text, next typed glyph extends the record */
+#define RL_UNDO_CHAIN  2  /* undone together with the previous record */
+
+#ifdef RL_UNDO_SIZE
+/* The undo log is a stack of edit records in rl_state->undo:
+     rl_undo_op_t, `count` glyphs, unsigned short size of the whole record.
+   The oldest records are dropped when the log is full. */
+
+typedef
+struct rl_undo_op {
+	unsigned short pos, count;
+	unsigned char type, flags;
+} rl_undo_op_t;
+
+#define RL_UNDO_REC_SIZE(count) \
+	(sizeof(rl_undo_op_t) + (count) * sizeof(rl_glyph_t) + sizeof(unsigned short))
+
+/* -------------------------------------------------------------------------- */
+static inline void undo_reset()
+{
+	rl_state->undo_top = rl_state->undo_end = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static inline rl_undo_op_t undo_op(int at)
+{
+	rl_undo_op_t op;
+	memcpy(&op, rl_state->undo + at, sizeof(op));
+	return op;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Offset of the last done record */
+static inline int undo_last()
+{
+	unsigned short size;
+	memcpy(&size, rl_state->undo + rl_state->undo_top - sizeof(size), sizeof(size));
+	return rl_state->undo_top - size;
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC int undo_drop_oldest()
+{
+	rl_state_t *s = rl_state;
+	int size = RL_UNDO_REC_SIZE(undo_op(0).count);
+	memmove(s->undo, s->undo + size, s->undo_end - size);
+	s->undo_top -= size;
+	s->undo_end -= size;
+	if (s->undo_end)
+		s->undo[offsetof(rl_undo_op_t, flags)] &= ~RL_UNDO_CHAIN;
+	return size;
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void undo_push(int type, int pos, rl_glyph_t const *glyphs, int count, int flags)
+{
+	rl_state_t *s = rl_state;
+	if (s->undo_busy)
+		return;
+
+	s->undo_end = s->undo_top; /* a new change forgets redo */
+
+	if (RL_UNDO_REC_SIZE(count) > sizeof(s->undo)) {
+		undo_reset(); /* the change is too big to be undone */
+		return;
+	}
+
+	unsigned short size = RL_UNDO_REC_SIZE(count);
+
+	if ((flags & RL_UNDO_TYPED) && s->undo_top && count == 1) {
+		int last = undo_last();
+		rl_undo_op_t op = undo_op(last);
+		rl_glyph_t prev;
+		memcpy(&prev, s->undo + last + RL_UNDO_REC_SIZE(op.count - 1) - sizeof(size), sizeof(prev));
+
+		/* words are undone one by one */
+		if (op.type == RL_UNDO_INSERT && (op.flags & RL_UNDO_TYPED) &&
+		    op.pos + op.count == pos && !(prev == ' ' && glyphs[0] != ' ')) {
+			while (s->undo_top + sizeof(rl_glyph_t) > sizeof(s->undo) && last)
+				last -= undo_drop_oldest();
+
+			if (s->undo_top + sizeof(rl_glyph_t) <= sizeof(s->undo)) {
+				++op.count;
+				size = RL_UNDO_REC_SIZE(op.count);
+				memcpy(s->undo + last, &op, sizeof(op));
+				memcpy(s->undo + s->undo_top - sizeof(size), glyphs, sizeof(rl_glyph_t));
+				memcpy(s->undo + last + size - sizeof(size), &size, sizeof(size));
+				s->undo_top = s->undo_end = last + size;
+				return;
+			}
+		}
+	}
+
+	while (s->undo_top + size > sizeof(s->undo))
+		undo_drop_oldest();
+
+	rl_undo_op_t op = { .pos = pos, .count = count, .type = type, .flags = flags };
+	unsigned char *rec = s->undo + s->undo_top;
+	memcpy(rec, &op, sizeof(op));
+	memcpy(rec + sizeof(op), glyphs, count * sizeof(rl_glyph_t));
+	memcpy(rec + size - sizeof(size), &size, sizeof(size));
+	s->undo_top = s->undo_end = s->undo_top + size;
 }
+#else
+static inline void undo_reset() {}
+static inline void undo_push(int type, int pos, rl_glyph_t const *glyphs, int count, int flags) {}
+#endif
 
 /* -------------------------------------------------------------------------- */
-STATIC void rl_set_text(char const *text, int redraw)
+STATIC void rl_edit_insert(int pos, rl_glyph_t const *glyphs, int count, int flags)
 {
-	if (redraw)
-		rlc_cursor_home();
+	rl_state_t *s = rl_state;
+	int max_count = countof(s->line) - s->length - 1;
+	if (count > max_count)
+		count = max_count;
 
-	int oldlen = rl_state->length;
+	if (count <= 0)
+		return;
 
-	strncpy(rl_state->raw, text, sizeof(rl_state->raw) - 1);
-	rl_state->raw[sizeof(rl_state->raw) - 1] = 0;
-	rl_glyph_t *end = utf8tog(rl_state->line, rl_state->raw);
-	rl_state->length = rl_state->cur_pos = end - rl_state->line;
+	undo_push(RL_UNDO_INSERT, pos, glyphs, count, flags);
 
-	if (redraw) {
-		rl_write_part(0, rl_state->length);
-		if (oldlen > rl_state->length)
-			rl_update_tail(oldlen - rl_state->length);
+	if (s->length - pos) {
+		memmove(
+			s->line + pos + count,
+			s->line + pos,
+			sizeof(s->line[0]) * (s->length - pos));
+		memmove(s->attr + pos + count, s->attr + pos, s->length - pos);
 	}
+
+	memcpy(s->line + pos, glyphs, sizeof(glyphs[0]) * count);
+	memset(s->attr + pos, pos ? s->attr[pos - 1] : 0, count); /* until highlighted */
+
+	s->length += count;
+	s->drawn = 0;
+	s->line[s->length] = 0;
+	rl_cols_dirty(pos);
+	rl_highlight_dirty(pos, count);
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_edit_delete(int pos, int count, int flags)
+{
+	rl_state_t *s = rl_state;
+	if (count > s->length - pos)
+		count = s->length - pos;
+
+	if (count <= 0)
+		return;
+
+	undo_push(RL_UNDO_DELETE, pos, s->line + pos, count, flags);
+
+	memmove(
+		s->line + pos,
+		s->line + pos + count,
+		(s->length - pos - count + 1) * sizeof(rl_glyph_t));
+	memmove(s->attr + pos, s->attr + pos + count, s->length - pos - count);
+	s->length -= count;
+	s->drawn = 0;
+	rl_cols_dirty(pos);
+	rl_highlight_dirty(pos, -count);
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rlc_cursor_home()
+{
+	rl_state->cur_pos = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_set_text(char const *text)
+{
+	rl_glyph_t uc[RL_MAX_LENGTH];
+	rl_glyph_t *end = utf8tog(uc, text, countof(uc) - 1);
+
+	int flags = rl_state->length ? RL_UNDO_CHAIN : 0;
+	rl_edit_delete(0, rl_state->length, 0);
+	rl_edit_insert(0, uc, end - uc, flags);
+	rl_state->cur_pos = rl_state->length;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -574,44 +1783,60 @@ STATIC void history_pop(int idx)
 	rl_history_t *h = &rl_state->history;
 
 	if (idx == h->size)
-		if (h->line) {
-			rl_set_text(h->line, 1);
-			free(h->line); h->line = NULL;
+		if (h->line_saved) {
+			rl_set_text(h->line);
+			h->line_saved = 0;
 			return ;
 		}
 
 	if (idx >= h->size)
 		return;
 
-	if (!h->line) {
+	if (!h->line_saved) {
 		gtoutf8(rl_state->raw, rl_state->line, -1);
-		h->line = strdup(rl_state->raw);
+		h->line_saved = !!rl_strstore(&h->line, &h->line_size, rl_state->raw);
 	}
 
-	rl_set_text(h->lines[idx], 1);
+	rl_set_text(h->lines[idx]);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Takes the suggested end of the line */
+STATIC int rl_suggestion_accept()
+{
+	char const *ghost = rl_suggestion();
+	if (ghost)
+		rl_insert_seq(ghost, 0);
+	return !!ghost;
 }
 
 /* -------------------------------------------------------------------------- */
 STATIC void rlc_cursor_end()
 {
-	rl_write_part(rl_state->cur_pos, -1);
-	rl_state->cur_pos = rl_state->length;
+	if (!rl_suggestion_accept())
+		rl_state->cur_pos = rl_state->length;
 }
 
 /* -------------------------------------------------------------------------- */
 STATIC void rlc_cursor_left()
 {
-	if (rl_state->cur_pos) {
-		rl_move(-1);
-		--rl_state->cur_pos;
-	}
+	rl_state_t *s = rl_state;
+	if (s->cur_pos)
+		do {
+			--s->cur_pos;
+		} while (s->cur_pos && glyph_mark(s->line[s->cur_pos])); /* combining marks */
 }
 
 /* -------------------------------------------------------------------------- */
 STATIC void rlc_cursor_right()
 {
-	if (rl_state->cur_pos < rl_state->length)
-		rl_write_part(rl_state->cur_pos++, 1);
+	rl_state_t *s = rl_state;
+	if (rl_suggestion_accept())
+		return;
+	if (s->cur_pos < s->length)
+		do {
+			++s->cur_pos;
+		} while (s->cur_pos < s->length && glyph_mark(s->line[s->cur_pos]));
 }
 
 /* -------------------------------------------------------------------------- */
@@ -621,14 +1846,12 @@ STATIC void rlc_cursor_word_left()
 		return;
 
 	unsigned int pos = rl_state->cur_pos;
-	rl_glyph_t *line = rl_state->line;
 	while (pos && rl_state->line[pos-1] == ' ')
 		--pos;
 
 	while (pos && rl_state->line[pos-1] != ' ')
 		--pos;
 
-	rl_move(pos - rl_state->cur_pos);
 	rl_state->cur_pos = pos;
 }
 
@@ -636,7 +1859,6 @@ STATIC void rlc_cursor_word_left()
 STATIC int rlc_next_word()
 {
 	unsigned int pos = rl_state->cur_pos, length = rl_state->length;
-	rl_glyph_t *line = rl_state->line;
 	while (pos < length && rl_state->line[pos] != ' ')
 		++pos;
 
@@ -651,25 +1873,13 @@ STATIC void rlc_cursor_word_right()
 	if (rl_state->cur_pos >= rl_state->length)
 		return;
 
-	unsigned int pos = rlc_next_word();
-	rl_write_part(rl_state->cur_pos, pos - rl_state->cur_pos);
-	rl_state->cur_pos = pos;
+	rl_state->cur_pos = rlc_next_word();
 }
 
 /* -------------------------------------------------------------------------- */
 STATIC void rlc_delete_n(int count)
 {
-	if (rl_state->cur_pos < rl_state->length && count) {
-		int tail = (rl_state->length - rl_state->cur_pos);
-		if (count > tail)
-			count = tail;
-		memmove(
-			rl_state->line + rl_state->cur_pos,
-			rl_state->line + rl_state->cur_pos + count,
-			(rl_state->length - rl_state->cur_pos - count + 1) * sizeof(rl_glyph_t));
-		rl_state->length -= count;
-		rl_update_tail(count);
-	}
+	rl_edit_delete(rl_state->cur_pos, count, 0);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -682,7 +1892,6 @@ STATIC void rlc_delete()
 STATIC void rlc_backspace()
 {
 	if (rl_state->cur_pos) {
-		rl_move(-1);
 		--rl_state->cur_pos;
 		rlc_delete_n(1);
 	}
@@ -717,6 +1926,58 @@ STATIC void rlc_delete_to_end()
 	rlc_delete_n(rl_state->length - rl_state->cur_pos);
 }
 
+#ifdef RL_UNDO_SIZE
+/* -------------------------------------------------------------------------- */
+STATIC void rlc_undo()
+{
+	rl_state_t *s = rl_state;
+	rl_glyph_t uc[RL_MAX_LENGTH];
+	int chain = 1;
+
+	s->undo_busy = 1;
+	while (s->undo_top && chain) {
+		int at = undo_last();
+		rl_undo_op_t op = undo_op(at);
+		if (op.type == RL_UNDO_INSERT) {
+			rl_edit_delete(op.pos, op.count, 0);
+			s->cur_pos = op.pos;
+		} else {
+			memcpy(uc, s->undo + at + sizeof(op), op.count * sizeof(uc[0]));
+			rl_edit_insert(op.pos, uc, op.count, 0);
+			s->cur_pos = op.pos + op.count;
+		}
+		s->undo_top = at;
+		chain = op.flags & RL_UNDO_CHAIN;
+	}
+	s->undo_busy = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rlc_redo()
+{
+	rl_state_t *s = rl_state;
+	rl_glyph_t uc[RL_MAX_LENGTH];
+
+	s->undo_busy = 1;
+	do {
+		if (s->undo_top >= s->undo_end)
+			break;
+
+		rl_undo_op_t op = undo_op(s->undo_top);
+		if (op.type == RL_UNDO_INSERT) {
+			memcpy(uc, s->undo + s->undo_top + sizeof(op), op.count * sizeof(uc[0]));
+			rl_edit_insert(op.pos, uc, op.count, 0);
+			s->cur_pos = op.pos + op.count;
+		} else {
+			rl_edit_delete(op.pos, op.count, 0);
+			s->cur_pos = op.pos;
+		}
+		s->undo_top += RL_UNDO_REC_SIZE(op.count);
+	} while (s->undo_top < s->undo_end && (undo_op(s->undo_top).flags & RL_UNDO_CHAIN));
+	s->undo_busy = 0;
+}
+#endif
+
 /* -------------------------------------------------------------------------- */
 STATIC void rlc_history_back()
 {
@@ -749,6 +2010,50 @@ STATIC void rlc_history_end()
 		history_pop((h->current = h->size));
 }
 
+/* -------------------------------------------------------------------------- */
+/* Moves the cursor `rows` up (< 0) or down within a line with breaks, to the
+   glyph at or before its column. Returns 0 when there is no such row. */
+STATIC int rl_row_move(int rows)
+{
+	rl_state_t *s = rl_state;
+	int cols = rl_window.cols, pos;
+	if (!cols)
+		return 0;
+	for (pos = 0; pos < s->length && s->line[pos] != '\n'; ++pos)
+		;
+	if (pos == s->length)
+		return 0;
+
+	int col = rl_col(s->cur_pos) + rows * cols, row = col / cols;
+	if (col < 0 || row < rl_col(0) / cols || row > rl_col(s->length) / cols)
+		return 0;
+
+	pos = rl_col(s->length) <= col ? s->length : rl_col_pos(col + 1) - 1;
+	s->cur_pos = pos > 0 ? pos : 0;
+	return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rlc_row_up()
+{
+	if (!rl_row_move(-1))
+		rlc_history_back();
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rlc_row_down()
+{
+	if (!rl_row_move(1))
+		rlc_history_forward();
+}
+
+/* -------------------------------------------------------------------------- */
+/* Continues the line on the next row */
+STATIC void rlc_line_break()
+{
+	rl_insert_seq("\n", 0);
+}
+
 /* -------------------------------------------------------------------------- */
 STATIC void rlc_enter()
 {
@@ -765,9 +2070,12 @@ STATIC void rlc_autocomplete()
 	char *cur_pos = gtoutf8(start, rl_state->line, rl_state->cur_pos);
 	char *end = gtoutf8(cur_pos, rl_state->line + rl_state->cur_pos, rl_state->length - rl_state->cur_pos);
 
+	STAT_ADD(completions, 1);
+	STAT_START(started);
 	char const *insert = (rl_state->_get_completion)(start, cur_pos);
+	STAT_TIME(&rl_stats_data.completion, started);
 	if (insert)
-		rl_insert_seq(insert);
+		rl_insert_seq(insert, 0);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -782,6 +2090,7 @@ static const struct _rl_command rl_commands[] = {
 	{ "\004",      rlc_delete },
 	{ "\027",      rlc_backword },
 	{ "\033d",     rlc_delete_word },
+	{ "\033\177",  rlc_backword },
 	{ "\013",      rlc_delete_to_end },
 	{ "\025",      rlc_delete_to_begin },
 	{ "\t",        rlc_autocomplete },
@@ -789,16 +2098,23 @@ static const struct _rl_command rl_commands[] = {
 	{ "\016",      rlc_history_forward },
 	{ "\033<",     rlc_history_begin },
 	{ "\033>",     rlc_history_end },
+#ifdef RL_UNDO_SIZE
+	{ "\037",      rlc_undo },
+	{ "\036",      rlc_redo },
+	{ "\033\037",  rlc_redo },
+#endif
 
 /* VT100 */
 	{ "\033OH",    rlc_cursor_home },
 	{ "\033OF",    rlc_cursor_end },
-	{ "\033[A",    rlc_history_back },
-	{ "\033[B",    rlc_history_forward },
+	{ "\033[A",    rlc_row_up },
+	{ "\033[B",    rlc_row_down },
 	{ "\033[D",    rlc_cursor_left },
 	{ "\033[C",    rlc_cursor_right },
 	{ "\033[1;5D", rlc_cursor_word_left },
 	{ "\033[1;5C", rlc_cursor_word_right },
+	{ "\033[1;3D", rlc_cursor_word_left },
+	{ "\033[1;3C", rlc_cursor_word_right },
 	{ "\033[3~",   rlc_delete },
 	{ "\x7F",      rlc_backspace },
 
@@ -808,72 +2124,150 @@ static const struct _rl_command rl_commands[] = {
 	{ "\033OD",    rlc_cursor_word_left },
 	{ "\033OC",    rlc_cursor_word_right },
 
+/* xterm, rxvt */
+	{ "\033[F",    rlc_cursor_end },
+	{ "\033[7~",   rlc_cursor_home },
+	{ "\033[8~",   rlc_cursor_end },
+	{ "\033Od",    rlc_cursor_word_left },
+	{ "\033Oc",    rlc_cursor_word_right },
+
 /* Hyper Terminal */
 	{ "\033[H",    rlc_cursor_home },
 	{ "\033[K",    rlc_cursor_end },
 
 /* VT52 */
 	{ "\033H",     rlc_cursor_home },
-	{ "\033A",     rlc_history_back },
-	{ "\033B",     rlc_history_forward },
+	{ "\033A",     rlc_row_up },
+	{ "\033B",     rlc_row_down },
 	{ "\033D",     rlc_cursor_left },
 	{ "\033C",     rlc_cursor_right },
 	{ "\033K",     rlc_delete_to_end },
 
+	{ "\033\r",    rlc_line_break },
+	{ "\033\n",    rlc_line_break },
 	{ "\n",        rlc_enter },
 	{ "\r",        rlc_enter }
 };
 
+#ifdef RL_STATS
 /* -------------------------------------------------------------------------- */
-void rl_insert_seq(char const *seq)
-{
-	rl_glyph_t uc[RL_MAX_LENGTH*2];
-	rl_glyph_t *end = utf8tog(uc, seq);
-	int count = end - uc;
-	int max_count = countof(rl_state->line) - rl_state->length - 1;
-	if (count > max_count)
-		count = max_count;
+/* latency of rl_commands[] handlers and of typed and pasted text */
+enum { RL_STAT_INSERT = countof(rl_commands), RL_STAT_PASTE };
 
-	if (!count)
-		return;
-
-	if (rl_state->length - rl_state->cur_pos)
-		memmove(
-			rl_state->line + rl_state->cur_pos + count, 
-			rl_state->line + rl_state->cur_pos, 
-			sizeof(rl_state->line[0]) * (rl_state->length - rl_state->cur_pos));
+static rl_histogram_t rl_key_stats[RL_STAT_PASTE + 1];
 
-	memcpy(
-		rl_state->line + rl_state->cur_pos, 
-		uc,
-		sizeof(uc[0]) * count);
+/* -------------------------------------------------------------------------- */
+rl_stats_t const *rl_stats()
+{
+	return &rl_stats_data;
+}
+
+/* -------------------------------------------------------------------------- */
+void rl_stats_reset()
+{
+	memset(&rl_stats_data, 0, sizeof(rl_stats_data));
+	memset(rl_key_stats, 0, sizeof(rl_key_stats));
+}
+
+/* -------------------------------------------------------------------------- */
+/* Key sequence in the readable form: ^A, \e[D */
+static void rl_key_name(char *name, char const *seq)
+{
+	for (; *seq; ++seq) {
+		int ch = (unsigned char)*seq;
+		if (ch == '\033')
+			*name++ = '\\', *name++ = 'e';
+		else
+			if (ch < ' ' || ch == 0x7F)
+				*name++ = '^', *name++ = ch ^ 0x40;
+			else
+				*name++ = ch;
+	}
+	*name = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void rl_stats_keys(rl_stats_key_fn *fn, void *ctx)
+{
+	char name[2 * sizeof(rl_commands[0].seq) + 1];
+	for (int i = 0; i < countof(rl_key_stats); ++i) {
+		if (!rl_key_stats[i].count)
+			continue;
+		if (i < countof(rl_commands))
+			rl_key_name(name, rl_commands[i].seq);
+		else
+			strcpy(name, i == RL_STAT_INSERT ? "insert" : "paste");
+		fn(name, rl_key_stats + i, ctx);
+	}
+}
+#endif
+
+/* -------------------------------------------------------------------------- */
+void rl_insert_seq(char const *seq, int flags)
+{
+	rl_glyph_t uc[RL_MAX_LENGTH];
+	rl_glyph_t *end = utf8tog(uc, seq, countof(uc) - 1);
+	int length = rl_state->length;
+	rl_edit_insert(rl_state->cur_pos, uc, end - uc, flags);
+	rl_state->cur_pos += rl_state->length - length;
+}
 
-	rl_state->length += count;
-	rl_state->line[rl_state->length] = 0;
+/* -------------------------------------------------------------------------- */
+/* A printable ASCII char typed at the end of the line shown as it is goes
+   to the line and the screen at once, the frame finds nothing to draw then.
+   Returns 0 when the char needs the general way: a highlighter is set (the
+   char's style is not known before it runs), a suggestion is shown after the
+   line, or the char would take the last column of a row. */
+STATIC int rl_append_fast(int ch)
+{
+	rl_state_t *s = rl_state;
+	int pos = s->length;
+	if (!s->drawn || s->_highlight || s->cur_pos != pos || s->shown_length != pos ||
+			pos >= countof(s->line) - 1)
+		return 0;
+
+	int col = rl_col(pos);
+	if (s->shown_col != col || s->shown_end != col || (rl_window.cols && !((col + 1) % rl_window.cols)))
+		return 0;
 
-	rl_write_part(rl_state->cur_pos, count);
-	rl_state->cur_pos += count;
-	rl_update_tail(0);
+	rl_glyph_t glyph = ch;
+	undo_push(RL_UNDO_INSERT, pos, &glyph, 1, RL_UNDO_TYPED);
+
+	s->line[pos] = s->shown[pos] = ch;
+	s->line[pos + 1] = 0;
+	s->attr[pos] = s->shown_attr[pos] = 0;
+	s->col[pos + 1] = s->shown_cols[pos + 1] = col + 1;
+	s->cols_valid = pos + 2;
+	s->length = s->shown_length = s->cur_pos = pos + 1;
+	s->shown_col = s->shown_end = col + 1;
+	rl_highlight_dirty(pos, 1);
+
+	char byte = ch;
+	rl_out(&byte, 1);
+	return 1;
 }
 
 /* -------------------------------------------------------------------------- */
-STATIC int rl_exec_seq(char *seq)
+STATIC int rl_exec_seq(char const *seq)
 {
 	const struct _rl_command *cmd = rl_commands, *end = rl_commands + countof(rl_commands);
 
+	STAT_START(started);
 	while (cmd < end) {
 		if (!strcmp(cmd->seq, seq)) {
 			cmd->handler();
+			STAT_TIME(rl_key_stats + (cmd - rl_commands), started);
 			goto _exit;
 		}
 		++cmd;
 	}
 
-	if (seq[0] & 0xE0)
-		rl_insert_seq(seq);
+	if (seq[0] & 0xE0) {
+		rl_insert_seq(seq, RL_UNDO_TYPED);
+		STAT_TIME(rl_key_stats + RL_STAT_INSERT, started);
+	}
 
 _exit:
-	rl_out_purge();
 	return rl_state->finish;
 }
 
@@ -884,57 +2278,387 @@ STATIC void history_save()
 	if (!file)
 		return;
 
-	char buf[RL_MAX_LENGTH*2], *in = buf;
 	int fd = open(file, O_CREAT|O_WRONLY|O_TRUNC, 0644);
 	if (fd < 0)
 		return;
 
 	rl_history_t *h = &rl_state->history;
-	int c = h->size;
-	char **pos = h->lines;
-	while (c--) {
-		if (write(fd, pos[0], strlen(pos[0])) < 0 || write(fd, "\n", 1) < 0)
+	for (int i = 0; i < h->size; ++i) {
+		char buf[RL_MAX_LENGTH*8 + 32];
+		char *to = buf + snprintf(buf, 32, ": %u:%u;", h->meta[i].time, h->meta[i].count);
+		for (char const *line = h->lines[i]; *line && to < buf + sizeof(buf) - 3; ++line) {
+			if (*line == '\\' || *line == '\n') /* a break inside is "\\\n" */
+				*to++ = '\\';
+			*to++ = *line;
+		}
+		*to++ = '\n';
+		if (write(fd, buf, to - buf) < 0)
 			break;
-		++pos;
 	}
 
 	close(fd);
 }
 
 /* -------------------------------------------------------------------------- */
+/* Frecency of a line: a use counts 2^(-age / RL_HISTORY_HALFLIFE), all of
+   them are taken as made at the last one. The rank log2(count) + time /
+   half-life orders lines as the score at any later moment, so it does not
+   change while the line is not used. log2 is linear between powers of 2. */
+static float history_rank(unsigned int time, unsigned int count)
+{
+	int exp = 0;
+	while (count >> (exp + 1))
+		++exp;
+	return (float)time / RL_HISTORY_HALFLIFE + exp + (float)(count - (1u << exp)) / (1u << exp);
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned int history_time()
+{
+#ifdef RL_TRACE
+	if (rl_trace.replay)
+		return rl_trace.clock / 1000;
+#endif
+	return time(NULL);
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned int history_hash(char const *line)
+{
+	unsigned int hash = 2166136261u;
+	while (*line)
+		hash = (hash ^ (unsigned char)*line++) * 16777619u;
+	return hash;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Index of the line with the id, -1 if it is gone */
+static int history_find(rl_history_t *h, unsigned int id)
+{
+	int lo = 0, hi = h->size;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (h->meta[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < h->size && h->meta[lo].id == id ? lo : -1;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Whether line `a` is ranked above line `b` (ids), the newer one on a tie */
+static int history_above(rl_history_t *h, unsigned int a, unsigned int b)
+{
+	float ra = h->meta[history_find(h, a)].rank, rb = h->meta[history_find(h, b)].rank;
+	return ra > rb || (ra == rb && a > b);
+}
+
+/* -------------------------------------------------------------------------- */
+/* top[] is kept as lines are added: a rank only grows, so a line used again
+   goes up and the last one is pushed out. */
+static void top_drop(rl_history_t *h, unsigned int id)
+{
+	for (int i = 0; i < h->top_count; ++i)
+		if (h->top[i] == id) {
+			--h->top_count;
+			memmove(h->top + i, h->top + i + 1, sizeof(h->top[0]) * (h->top_count - i));
+			return;
+		}
+}
+
+/* -------------------------------------------------------------------------- */
+static void top_raise(rl_history_t *h, unsigned int id)
+{
+	top_drop(h, id);
+	int pos = h->top_count;
+	while (pos > 0 && history_above(h, id, h->top[pos - 1]))
+		--pos;
+	if (pos >= RL_HISTORY_TOP)
+		return;
+
+	if (h->top_count < RL_HISTORY_TOP)
+		++h->top_count;
+	memmove(h->top + pos + 1, h->top + pos, sizeof(h->top[0]) * (h->top_count - pos - 1));
+	h->top[pos] = id;
+}
+
+/* -------------------------------------------------------------------------- */
+static void top_rebuild(rl_history_t *h)
+{
+	h->top_count = 0;
+	for (int i = 0; i < h->size; ++i)
+		top_raise(h, h->meta[i].id);
+}
+
+/* -------------------------------------------------------------------------- */
+/* The prefix index of history is a trie of the lines' bytes. Every node keeps
+   the best ranked line passing it, so a suggestion is found in one walk down
+   by the prefix. Nodes come from a pool, freed ones are reused. */
+static int trie_grow(rl_history_t *h)
+{
+	int size = h->trie_size ? h->trie_size * 2 : 256;
+	rl_trie_node_t *trie = rl_realloc(h->trie, size * sizeof(*trie));
+	if (!trie)
+		return -1;
+
+	int first = h->trie_size ? h->trie_size : 1;
+	if (!h->trie_size)
+		memset(trie, 0, sizeof(*trie)); /* the root */
+	for (int i = first; i < size; ++i)
+		trie[i].next = i + 1 < size ? i + 1 : 0;
+	h->trie_free = first;
+	h->trie = trie;
+	h->trie_size = size;
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Returns a new node or 0 */
+static int trie_node(rl_history_t *h, int byte)
+{
+	if (!h->trie_free && trie_grow(h) < 0)
+		return 0;
+
+	int node = h->trie_free;
+	rl_trie_node_t *n = h->trie + node;
+	h->trie_free = n->next;
+	memset(n, 0, sizeof(*n));
+	n->byte = byte;
+	return node;
+}
+
+/* -------------------------------------------------------------------------- */
+static void trie_clear(rl_history_t *h)
+{
+	if (!h->trie)
+		return;
+
+	h->trie[0].child = 0;
+	for (int i = 1; i < h->trie_size; ++i)
+		h->trie[i].next = i + 1 < h->trie_size ? i + 1 : 0;
+	h->trie_free = h->trie_size > 1;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Link to the child node of the byte */
+static int *trie_child(rl_history_t *h, int node, int byte)
+{
+	int *link = &h->trie[node].child;
+	while (*link && h->trie[*link].byte != byte)
+		link = &h->trie[*link].next;
+	return link;
+}
+
+/* -------------------------------------------------------------------------- */
+static void trie_add(rl_history_t *h, char const *line, unsigned int id)
+{
+	if (!h->trie)
+		return;
+
+	int node = 0;
+	for (; *line; ++line) {
+		int byte = (unsigned char)*line;
+		int *link = trie_child(h, node, byte);
+		if (!*link) {
+			int child = trie_node(h, byte); /* the pool can move */
+			if (!child)
+				return;
+			link = trie_child(h, node, byte);
+			*link = child;
+			h->trie[child].parent = node;
+		}
+		node = *link;
+		rl_trie_node_t *n = h->trie + node;
+		++n->count;
+		if (!n->best || history_above(h, id, n->best))
+			n->best = id;
+	}
+	h->trie[node].end = id;
+}
+
+/* -------------------------------------------------------------------------- */
+/* The best line through the node from its children */
+static unsigned int trie_best(rl_history_t *h, int node)
+{
+	unsigned int best = h->trie[node].end;
+	for (int child = h->trie[node].child; child; child = h->trie[child].next)
+		if (!best || history_above(h, h->trie[child].best, best))
+			best = h->trie[child].best;
+	return best;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Takes a line out: nodes only it was passing are freed, the nodes it was
+   the best of get the next one, bottom-up */
+static void trie_remove(rl_history_t *h, char const *line, unsigned int id)
+{
+	if (!h->trie)
+		return;
+
+	int node = 0;
+	for (; *line; ++line) {
+		int *link = trie_child(h, node, (unsigned char)*line);
+		int child = *link;
+		if (!child)
+			return;
+
+		if (!--h->trie[child].count) {
+			*link = h->trie[child].next;
+			h->trie[child].next = h->trie_free;
+			h->trie_free = child;
+			for (++line; *line; ++line) { /* the rest of the path is free as well */
+				child = *trie_child(h, child, (unsigned char)*line);
+				if (!child)
+					break;
+				h->trie[child].next = h->trie_free;
+				h->trie_free = child;
+			}
+			break;
+		}
+		node = child;
+	}
+	if (h->trie[node].end == id)
+		h->trie[node].end = 0;
+
+	for (; node && h->trie[node].best == id; node = h->trie[node].parent)
+		h->trie[node].best = trie_best(h, node);
+}
+
+/* -------------------------------------------------------------------------- */
+/* The end of the best ranked history line starting with the prefix, NULL if
+   none */
+STATIC char const *history_suggest(char const *prefix, int length)
+{
+	rl_history_t *h = &rl_state->history;
+	int node = 0;
+	for (int i = 0; i < length && (node = *trie_child(h, node, (unsigned char)prefix[i])); ++i)
+		;
+	if (!node)
+		return NULL;
+
+	int idx = history_find(h, h->trie[node].best);
+	if (idx < 0 || !h->lines[idx][length])
+		return NULL;
+	return h->lines[idx] + length;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Forgets the lines, their buffers are kept for the next ones */
 STATIC void history_empty()
+{
+	rl_state->history.size = rl_state->history.top_count = 0;
+	trie_clear(&rl_state->history);
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void history_free()
 {
 	rl_history_t *h = &rl_state->history;
-	int c = h->size;
-	char **pos = h->lines;
-	while (c--) {
-		free(*pos);
-		*pos++ = NULL;
-	}
-	h->size = 0;
+	for (int i = 0; i < countof(h->lines); ++i)
+		if (h->lines[i]) {
+			rl_free(h->lines[i]);
+			h->lines[i] = NULL;
+			h->sizes[i] = 0;
+		}
+	if (h->line)
+		rl_free(h->line);
+	if (h->trie)
+		rl_free(h->trie);
+	h->line = NULL;
+	h->trie = NULL;
+	h->size = h->top_count = h->line_size = h->line_saved = h->trie_size = h->trie_free = 0;
 }
 
 /* -------------------------------------------------------------------------- */
-STATIC void history_add(char const *string)
+/* Takes a line out, its buffer is kept behind `size` */
+static void history_remove(rl_history_t *h, int idx)
+{
+	trie_remove(h, h->lines[idx], h->meta[idx].id);
+	top_drop(h, h->meta[idx].id);
+
+	char *line = h->lines[idx];
+	int size = h->sizes[idx], rest = --h->size - idx;
+	memmove(h->lines + idx, h->lines + idx + 1, sizeof(h->lines[0]) * rest);
+	memmove(h->sizes + idx, h->sizes + idx + 1, sizeof(h->sizes[0]) * rest);
+	memmove(h->meta + idx, h->meta + idx + 1, sizeof(h->meta[0]) * rest);
+	h->lines[h->size] = line;
+	h->sizes[h->size] = size;
+}
+
+/* -------------------------------------------------------------------------- */
+/* A line used again is moved to the end with the uses summed up. A new line
+   takes the place of the lowest ranked one when history is full. */
+STATIC void history_put(char const *string, unsigned int time, unsigned int count)
 {
 	rl_history_t *h = &rl_state->history;
 
-	free(h->line); h->line = NULL;
+	h->line_saved = 0;
 	if (!string[0])
 		return;
-	if (h->size && !strcmp(h->lines[h->size-1], string)) {
-		h->current = h->size;
-		return;
+
+	unsigned int hash = history_hash(string);
+	int idx = h->size;
+	while (idx-- && (h->meta[idx].hash != hash || strcmp(h->lines[idx], string)))
+		;
+
+	if (idx >= 0) {
+		count += h->meta[idx].count;
+		if (time < h->meta[idx].time)
+			time = h->meta[idx].time;
+		history_remove(h, idx);
+	} else {
+		STAT_ADD(history_adds, 1);
+		if (h->size >= countof(h->lines)) {
+			STAT_ADD(history_evictions, 1);
+			int low = 0;
+			for (int i = 1; i < h->size; ++i)
+				if (h->meta[i].rank < h->meta[low].rank)
+					low = i;
+			history_remove(h, low);
+		}
 	}
 
-	if (h->size >= countof(h->lines)) {
-		free(h->lines[0]);
-		memmove(h->lines, h->lines+1, sizeof(h->lines[0])*--(h->size));
+	if (rl_strstore(h->lines + h->size, h->sizes + h->size, string)) {
+		rl_history_entry_t *e = h->meta + h->size++;
+		e->id = ++h->seq;
+		e->hash = hash;
+		e->time = time;
+		e->count = count < 0xFFFF ? count : 0xFFFF;
+		e->rank = history_rank(e->time, e->count);
+		trie_add(h, string, e->id);
+		top_raise(h, e->id);
 	}
-	h->lines[h->size++] = strdup(string);
+	if (h->top_count < h->size && h->top_count < RL_HISTORY_TOP)
+		top_rebuild(h); /* a line of top[] was pushed out of history */
 	h->current = h->size;
 }
 
+/* -------------------------------------------------------------------------- */
+STATIC void history_add(char const *string)
+{
+	history_put(string, history_time(), 1);
+}
+
+/* -------------------------------------------------------------------------- */
+/* A line is ": time:count;text", a plain one is taken as used once when the
+   file was written. "\\\\" in the text is a backslash, "\\\n" a break. */
+static void history_load_line(char *line, unsigned int mtime)
+{
+	char *to = line;
+	for (char const *from = line; *from; *to++ = *from++)
+		if (from[0] == '\\' && (from[1] == '\\' || from[1] == '\n'))
+			++from;
+	*to = 0;
+
+	unsigned int time, count;
+	int skip = 0;
+	if (line[0] == ':' && sscanf(line, ": %u:%u;%n", &time, &count, &skip) == 2 && skip)
+		history_put(line + skip, time, count ? count : 1);
+	else
+		history_put(line, mtime, 1);
+}
+
 /* -------------------------------------------------------------------------- */
 void readline_history_load(char const *file)
 {
@@ -949,68 +2673,239 @@ void readline_history_load(char const *file)
 	if (fd < 0)
 		return;
 
-	char line[RL_MAX_LENGTH*2 + 4];
+	struct stat st;
+	unsigned int mtime = fstat(fd, &st) ? 0 : st.st_mtime;
+
+	char line[RL_MAX_LENGTH*8 + 64];
 	char *in = line, *iend = line + sizeof(line) - 1;
 	int count;
 
 	while ((count = safe_read(fd, in, iend - in)) > 0) {
-		char *eoln, *end = in + count;
+		char *eoln, *start = line, *end = in + count;
 		for (eoln = in; eoln < end; ++eoln)
 			if (*eoln == '\n') {
+				char *esc = eoln;
+				while (esc > start && esc[-1] == '\\')
+					--esc;
+				if ((eoln - esc) % 2)
+					continue; /* the line goes on */
 				*eoln = 0;
-				history_add(in);
-				in = eoln + 1;
+				history_load_line(start, mtime);
+				start = eoln + 1;
 			}
-		if (in < end)
-			memmove(line, in, iend - in);
-		in = line + (iend - in);
+		memmove(line, start, end - start);
+		in = line + (end - start);
 	}
 
 	close(fd);
 }
 
 /* -------------------------------------------------------------------------- */
+int readline_history_top(char const *prefix, char const **lines, int max)
+{
+	rl_history_t *h = &rl_state->history;
+	int length = prefix ? strlen(prefix) : 0, found = 0;
+	if (max > RL_HISTORY_TOP)
+		max = RL_HISTORY_TOP;
+
+	for (int i = 0; i < h->top_count && found < max; ++i) {
+		char const *line = h->lines[history_find(h, h->top[i])];
+		if (!length || !strncmp(line, prefix, length))
+			lines[found++] = line;
+	}
+	if (found == max || h->top_count == h->size)
+		return found;
+
+	/* fewer matches are in top[] than asked: all the lines are ranked */
+	float rank[RL_HISTORY_TOP];
+	found = 0;
+	for (int i = h->size; i--; ) {
+		if (length && strncmp(h->lines[i], prefix, length))
+			continue;
+		int pos = found;
+		while (pos > 0 && h->meta[i].rank > rank[pos - 1])
+			--pos;
+		if (pos >= max)
+			continue;
+		if (found < max)
+			++found;
+		memmove(lines + pos + 1, lines + pos, sizeof(lines[0]) * (found - pos - 1));
+		memmove(rank + pos + 1, rank + pos, sizeof(rank[0]) * (found - pos - 1));
+		lines[pos] = h->lines[i];
+		rank[pos] = h->meta[i].rank;
+	}
+	return found;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Lays the line out again when the window width was changed. The terminal
+   reflows wrapped rows, so the cursor is found with the new width. Cells
+   in front of the column where the two layouts part stay, from there the
+   prompt row or the line is drawn again. */
 static void rl_update_window()
 {
-	if (!rl_window_check())
+	rl_state_t *s = rl_state;
+	int cols = rl_window.cols, width = rl_window_size();
+	if (width == cols)
 		return;
 
-	int cur_pos = rl_state->cur_pos;
-	int cols = rl_window.cols;
-	rlc_cursor_home();
-	rl_out_purge();
-	rl_window_update();
-	int tail = (1 + rl_window.cols - cols) * ((rl_state->prompt_width + rl_state->length) / cols);
-	rl_redraw(1, tail >= 0 ? tail : 0);
-	rl_move(cur_pos);
-	rl_state->cur_pos = cur_pos;
+	rl_window.cols = width;
+	s->cols_valid = 0;
+	if (s->in_linemode || (s->shown_end < cols && s->shown_end < width))
+		return;
+
+	int first = !cols || (width && width < cols) ? width : cols;
+	if (s->prompt_width >= first) {
+		rl_move(s->shown_col, 0);
+		rl_prompt_row(s->prompt);
+		rl_out(CLEAR_EOS, strlen(CLEAR_EOS));
+		rl_invalidate(0);
+	} else {
+		int keep = 0;
+		while (keep < s->shown_length && s->shown_cols[keep + 1] < first)
+			++keep;
+		int col = rl_col(keep);
+		rl_move(s->shown_col, col);
+		rl_out(CLEAR_EOS, strlen(CLEAR_EOS));
+		s->shown_length = keep;
+		s->shown_col = s->shown_end = col;
+		s->drawn = 0;
+	}
+	rl_render();
 	rl_out_purge();
 }
 
 /* -------------------------------------------------------------------------- */
-void readline_init(rl_get_completion_fn *gc)
+int readline_init(rl_get_completion_fn *gc)
 {
 	if (rl_state)
 		readline_free();
-	rl_state = (rl_state_t *)malloc(sizeof(rl_state_t));
+	rl_state = (rl_state_t *)rl_malloc(sizeof(rl_state_t));
+	if (!rl_state)
+		return -1;
 	memset(rl_state, 0, sizeof(*rl_state));
+	rl_state->in_fd = STDIN_FILENO;
+	rl_state->out_fd = STDOUT_FILENO;
 	rl_state->_get_completion = gc;
+	rl_out_init();
+	rl_notify_init();
 	rl_window_init();
+	return 0;
 }
 
 /* -------------------------------------------------------------------------- */
 void readline_free()
 {
+	readline_session(NULL);
 	if (!rl_state)
 		return;
 
+	rl_term_unraw(); /* kept raw after the last line */
 	rl_window_free();
+	rl_messages_print(0);
+	rl_out_free();
+	rl_notify_free();
 	history_save();
-	history_empty();
-	free(rl_state);
+	history_free();
+	rl_files_free();
+	if (rl_state->batch)
+		rl_free(rl_state->batch);
+	rl_free(rl_state);
 	rl_state = NULL;
 }
 
+#ifdef RL_USE_WRITE
+/* -------------------------------------------------------------------------- */
+/* Editor of a remote terminal. The current one has its parts in rl_state,
+   rl_output and rl_window.cols, readline_session() swaps them. */
+struct rl_session {
+	rl_state_t *state;
+	rl_output_t output;
+	int cols;
+};
+
+static rl_session_t rl_main_session, *rl_session_cur = &rl_main_session;
+
+/* -------------------------------------------------------------------------- */
+rl_session_t *readline_session(rl_session_t *session)
+{
+	rl_session_t *prev = rl_session_cur;
+	if (!session)
+		session = &rl_main_session;
+	if (session != prev) {
+		prev->state = rl_state;
+		prev->output = rl_output;
+		prev->cols = rl_window.cols;
+		rl_state = session->state;
+		rl_output = session->output;
+		rl_window.cols = session->cols;
+		rl_session_cur = session;
+	}
+	return prev == &rl_main_session ? NULL : prev;
+}
+
+/* -------------------------------------------------------------------------- */
+rl_session_t *readline_session_new(int in_fd, int out_fd, int cols)
+{
+	rl_session_t *session = (rl_session_t *)rl_malloc(sizeof(*session));
+	rl_state_t *s = (rl_state_t *)rl_malloc(sizeof(rl_state_t));
+	if (!session || !s) {
+		if (session)
+			rl_free(session);
+		if (s)
+			rl_free(s);
+		return NULL;
+	}
+	memset(session, 0, sizeof(*session));
+	memset(s, 0, sizeof(*s));
+	s->in_fd = in_fd;
+	s->out_fd = out_fd;
+	s->remote = 1;
+	if (rl_state) { /* the settings of the current editor */
+		s->_get_completion = rl_state->_get_completion;
+		s->_highlight = rl_state->_highlight;
+		s->styles = rl_state->styles;
+		s->styles_count = rl_state->styles_count;
+	}
+
+	session->state = s;
+	session->output.sock = -1;
+#ifdef RL_WINDOW_WIDTH
+	session->cols = cols > 0 ? cols : RL_WINDOW_WIDTH;
+#else
+	session->cols = cols > 0 ? cols : 80;
+#endif
+	return session;
+}
+
+/* -------------------------------------------------------------------------- */
+/* The queued output is dropped, the fds are left to the caller */
+void readline_session_free(rl_session_t *session)
+{
+	if (!session || session == &rl_main_session)
+		return;
+
+	rl_session_t *prev = readline_session(session);
+	history_free();
+	if (rl_state->batch)
+		rl_free(rl_state->batch);
+	if (rl_output.data)
+		rl_free(rl_output.data);
+	rl_free(rl_state);
+
+	rl_session_cur = &rl_main_session; /* nothing to keep of this one */
+	rl_state = rl_main_session.state;
+	rl_output = rl_main_session.output;
+	rl_window.cols = rl_main_session.cols;
+	readline_session(prev == session ? NULL : prev);
+	rl_free(session);
+}
+#else
+rl_session_t *readline_session_new(int in_fd, int out_fd, int cols) { return NULL; }
+rl_session_t *readline_session(rl_session_t *session) { return NULL; }
+void readline_session_free(rl_session_t *session) {}
+#endif
+
 #ifdef RL_SORT_HINTS
 static int rl_strscmp(void const *l, void const *r)
 {
@@ -1039,8 +2934,7 @@ void rl_dump_options(char const * const *options)
 	if (!cols)
 		cols = 1;
 
-	int cur_pos = rl_state->cur_pos;
-	rlc_cursor_end();
+	rl_render_end();
 	rl_printf("\r\n");
 
 	opt = options;
@@ -1051,8 +2945,8 @@ void rl_dump_options(char const * const *options)
 		} while (*opt && --c);
 		rl_printf("\r\n");
 	}
-	rl_state->cur_pos = cur_pos;
-	rl_redraw(0, 0); /* not in place */
+	rl_out(rl_state->prompt, strlen(rl_state->prompt));
+	rl_invalidate(0); /* not in place */
 }
 
 /* -------------------------------------------------------------------------- */
@@ -1064,113 +2958,1574 @@ void rl_dump_hint(char const *fmt, ...)
 	int length = vsnprintf(outbuf, sizeof(outbuf), fmt, va);
 	va_end(va);
 
-	int cur_pos = rl_state->cur_pos;
-	rlc_cursor_end();
+	rl_render_end();
 	rl_printf("\n\r");
 
 	rl_out(outbuf, length);
 	rl_printf("\n\r");
-	rl_state->cur_pos = cur_pos;
-	rl_redraw(0, 0); /* not in place */
+	rl_out(rl_state->prompt, strlen(rl_state->prompt));
+	rl_invalidate(0); /* not in place */
 }
 
 /* -------------------------------------------------------------------------- */
-char *readline(char const *prompt, char const *string)
+/* Compiled prompt: literal text and named segments, see rl_prompt_new().
+   The printed text is built again only when a segment changes. */
+typedef
+struct rl_segment {
+	char const *name;
+	char const *before;    /* literal text in front of it */
+	int width;             /* cells, 0 -- as wide as the value */
+	char *value;
+	char *pending;         /* given by rl_prompt_set(), taken by the editor */
+	int changed;           /* by the last rl_prompt_take() */
+	int at, length;        /* bytes of the fitted value in text */
+	int col, cells;        /* place on the last row, -1 -- on a row above */
+} rl_segment_t;
+
+struct rl_prompt {
+	char *parts;           /* literal texts and names, zero-terminated */
+	char const *tail;      /* literal text behind the last segment */
+	char *text;            /* the prompt as it is printed */
+	int length, width;     /* bytes, cells of the last row */
+	int count;
+	rl_segment_t seg[];
+};
+
+/* -------------------------------------------------------------------------- */
+/* Copies the value cut or padded to `width` cells, 0 -- as is */
+static char *rl_prompt_fit(char *to, char const *value, int width, int *cells)
 {
-	if (!isatty(STDIN_FILENO)) {
-		if (fgets(rl_state->raw, sizeof(rl_state->raw), stdin) == NULL)
-			return NULL;
-		char *end = rl_state->raw + strlen(rl_state->raw) - 1;
-		while (*end == '\r' || *end == '\n')
-			--end;
-		*++end = 0;
-		return rl_state->raw;
+	*cells = 0;
+	int full = 0;
+	while (*value) {
+		if (*value == '\033') { /* sequences are kept even after a cut */
+			int length = esc_length(value);
+			memcpy(to, value, length);
+			to += length;
+			value += length;
+			continue;
+		}
+		char const *at = value;
+		rl_glyph_t gl = utf8_to_glyph(&value);
+		if (!gl) {
+			++value;
+			continue;
+		}
+		int gw = glyph_width(gl);
+		if (full || (width && *cells + gw > width)) {
+			full = 1;
+			continue;
+		}
+		memcpy(to, at, value - at);
+		to += value - at;
+		*cells += gw;
 	}
+	for (; *cells < width; ++*cells)
+		*to++ = ' ';
+	*to = 0;
+	return to;
+}
 
-	rl_state->raw[0] = 0;
-	rl_state->line[0] = 0;
-	rl_state->length = rl_state->cur_pos = rl_state->finish = 0;
-	rl_state->prompt = prompt;
-	rl_state->prompt_width = utf8_width(prompt);
+/* -------------------------------------------------------------------------- */
+STATIC int rl_prompt_build(rl_prompt_t *p)
+{
+	int size = strlen(p->tail) + 1;
+	for (int i = 0; i < p->count; ++i)
+		size += strlen(p->seg[i].before) + strlen(p->seg[i].value) + p->seg[i].width;
 
-	rl_term_raw();
-//	char const *term = getenv("TERM");
-//	rl_printf("width=%u; term=%s\n\r%s", rl_window.cols, term ?: "unknown", SET_WRAP_MODE);
-	rl_printf("%s", prompt);
+	char *text = (char *)rl_malloc(size), *to = text;
+	if (!text)
+		return -1;
+	for (int i = 0; i < p->count; ++i) {
+		rl_segment_t *seg = p->seg + i;
+		to = stpcpy(to, seg->before);
+		seg->at = to - text;
+		seg->col = utf8_width(text);
+		to = rl_prompt_fit(to, seg->value, seg->width, &seg->cells);
+		seg->length = to - text - seg->at;
+	}
+	to = stpcpy(to, p->tail);
+
+	for (int i = 0; i < p->count; ++i)
+		if (strpbrk(text + p->seg[i].at + p->seg[i].length, "\r\n"))
+			p->seg[i].col = -1;
+	if (p->text)
+		rl_free(p->text);
+	p->text = text;
+	p->length = to - text;
+	p->width = utf8_width(text);
+	return 0;
+}
 
-	if (string)
-		rl_set_text(string, 1);
+/* -------------------------------------------------------------------------- */
+void rl_prompt_free(rl_prompt_t *p)
+{
+	if (!p)
+		return;
+	if (rl_state && rl_state->compiled == p)
+		rl_state->compiled = NULL;
+	for (int i = 0; i < p->count; ++i) {
+		rl_free(p->seg[i].value);
+		if (p->seg[i].pending)
+			rl_free(p->seg[i].pending);
+	}
+	if (p->text)
+		rl_free(p->text);
+	rl_free(p->parts);
+	rl_free(p);
+}
 
-	rl_out_purge();
+/* -------------------------------------------------------------------------- */
+rl_prompt_t *rl_prompt_new(char const *format)
+{
+	int count = 0;
+	for (char const *at = format; (at = strstr(at, "%{")); at += 2)
+		++count;
 
-	int rdn;
-	char ch, seq[12], *seqpos = seq;
-	while (safe_read(STDIN_FILENO, &ch, 1) > 0) {
-		if (seqpos >= seq + sizeof(seq))
-			seqpos = seq; /* wrong sequence -- wrong reaction :) */
-		*seqpos++ = ch;
-		*seqpos = 0;
-		if (!skip_char_seq(seq))
-			continue; /* wrong seq */
-
-		if (rl_exec_seq(seq))
-			break; /* finish */
+	rl_prompt_t *p = (rl_prompt_t *)rl_malloc(sizeof(*p) + count * sizeof(p->seg[0]));
+	if (!p)
+		return NULL;
+	memset(p, 0, sizeof(*p) + count * sizeof(p->seg[0]));
+	p->parts = (char *)rl_malloc(strlen(format) + 1);
+	if (!p->parts) {
+		rl_free(p);
+		return NULL;
+	}
 
-		seqpos = seq;
+	/* parts are unescaped in place: the text only gets shorter */
+	char *r = strcpy(p->parts, format), *w = r, *before = w;
+	while (*r) {
+		char *end = r[0] == '%' && r[1] == '{' ? strchr(r + 2, '}') : NULL;
+		if (!end) {
+			*w++ = *r;
+			r += r[0] == '%' && r[1] == '%' ? 2 : 1;
+			continue;
+		}
+
+		rl_segment_t *seg = p->seg + p->count++;
+		*w++ = 0;
+		seg->before = before;
+		seg->name = w;
+		for (r += 2; r < end && *r != ':'; )
+			*w++ = *r++;
+		*w++ = 0;
+		seg->width = r < end ? atoi(r + 1) : 0;
+		seg->value = (char *)rl_malloc(1);
+		if (seg->value)
+			seg->value[0] = 0;
+		r = end + 1;
+		before = w;
 	}
+	*w = 0;
+	p->tail = before;
 
-	rlc_cursor_end();
-	gtoutf8(rl_state->raw, rl_state->line, -1);
-	
-	rl_term_unraw();
-	history_add(rl_state->raw);
-	rl_printf("\n");
-	rl_out_purge();
-	return rl_state->raw;
+	for (int i = 0; i < p->count; ++i)
+		if (!p->seg[i].value) {
+			rl_prompt_free(p);
+			return NULL;
+		}
+	if (rl_prompt_build(p) < 0) {
+		rl_prompt_free(p);
+		return NULL;
+	}
+	return p;
 }
 
-#ifdef RL_TEST
 /* -------------------------------------------------------------------------- */
-char *readline_test(char const *prompt, char const *string)
+int rl_prompt_set(rl_prompt_t *p, char const *name, char const *text)
 {
-	if (!isatty(STDIN_FILENO)) {
-		if (fgets(rl_state->raw, sizeof(rl_state->raw), stdin) == NULL)
-			return NULL;
-		char *end = rl_state->raw + strlen(rl_state->raw) - 1;
-		while (*end == '\r' || *end == '\n')
-			--end;
-		*++end = 0;
-		return rl_state->raw;
+	int found = 0;
+	for (int i = 0; i < p->count; ++i) {
+		rl_segment_t *seg = p->seg + i;
+		if (strcmp(seg->name, name))
+			continue;
+		char *value = (char *)rl_malloc(strlen(text) + 1);
+		if (!value)
+			return -1;
+		strcpy(value, text);
+		value = __atomic_exchange_n(&seg->pending, value, __ATOMIC_ACQ_REL);
+		if (value) /* not taken yet */
+			rl_free(value);
+		++found;
 	}
+	if (found)
+		rl_notify_send("p");
+	return found ? 0 : -1;
+}
+
+/* -------------------------------------------------------------------------- */
+void readline_prompt(rl_prompt_t *p)
+{
+	rl_state->compiled = p;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Takes the values given since the last call. Returns count of segments
+   changed, -1 if the text could not be built. */
+STATIC int rl_prompt_take(rl_prompt_t *p)
+{
+	int changed = 0;
+	for (int i = 0; i < p->count; ++i) {
+		rl_segment_t *seg = p->seg + i;
+		seg->changed = 0;
+		if (!__atomic_load_n(&seg->pending, __ATOMIC_RELAXED))
+			continue;
+		char *value = __atomic_exchange_n(&seg->pending, NULL, __ATOMIC_ACQUIRE);
+		if (!strcmp(seg->value, value)) {
+			rl_free(value);
+			continue;
+		}
+		rl_free(seg->value);
+		seg->value = value;
+		seg->changed = 1;
+		++changed;
+	}
+	if (changed && rl_prompt_build(p) < 0)
+		return -1;
+	return changed;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Writes the SGR sequences of the prompt text between `from` and `to`: the
+   style they leave is restored, other sequences (title, cursor moves,
+   clears) are not done again */
+static void rl_prompt_escapes(char const *from, char const *to)
+{
+	while (from < to)
+		if (*from == '\033') {
+			int length = esc_length(from);
+			if (from[1] == '[' && from[length - 1] == 'm')
+				rl_out(from, length);
+			from += length;
+		} else
+			++from;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Writes the last row of the prompt again, in the style the rows above
+   leave */
+static void rl_prompt_row(char const *prompt)
+{
+	char const *end = prompt + strlen(prompt), *row = end;
+	while (row > prompt && row[-1] != '\n' && row[-1] != '\r')
+		--row;
+	rl_prompt_escapes(prompt, row);
+	rl_out(row, end - row);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Draws changed segments of the prompt being edited. A segment of the same
+   width is written over in place, otherwise the last row of the prompt and
+   the line are drawn again. */
+STATIC void rl_prompt_update()
+{
+	rl_state_t *s = rl_state;
+	rl_prompt_t *p = s->compiled;
+	if (!p || s->prompt != p->text)
+		return; /* not shown */
+
+	int width = p->width, cells[p->count + 1];
+	for (int i = 0; i < p->count; ++i)
+		cells[i] = p->seg[i].cells;
+	if (rl_prompt_take(p) <= 0)
+		return;
+
+	s->prompt = p->text;
+	if (s->in_linemode || s->finish)
+		return; /* the terminal has the line, drawn by the next prompt */
+
+	int in_place = rl_window.cols && p->width == width;
+	for (int i = 0; i < p->count; ++i)
+		if (p->seg[i].changed && p->seg[i].col >= 0 && p->seg[i].cells != cells[i])
+			in_place = 0;
+
+	rl_sgr_reset();
+	if (!in_place) {
+		rl_move(s->shown_col, 0);
+		rl_prompt_row(p->text);
+		rl_out(CLEAR_EOS, strlen(CLEAR_EOS));
+		s->prompt_width = p->width;
+		rl_invalidate(0);
+		rl_render();
+		rl_out_purge();
+		return;
+	}
+
+	for (int i = 0; i < p->count; ++i) {
+		rl_segment_t *seg = p->seg + i;
+		if (!seg->changed || seg->col < 0)
+			continue;
+		int end = seg->col + seg->cells;
+		rl_move(s->shown_col, seg->col);
+		rl_prompt_escapes(p->text, p->text + seg->at);
+		rl_out(p->text + seg->at, seg->length);
+		rl_prompt_escapes(p->text + seg->at + seg->length, p->text + p->length);
+		if (seg->cells && !(end % rl_window.cols))
+			rl_out("\r\n", 2);
+		s->shown_col = end;
+	}
+	rl_move(s->shown_col, rl_col(s->cur_pos));
+	s->shown_col = rl_col(s->cur_pos);
+	rl_out_purge();
+}
+
+#ifndef RL_FILES_CACHE
+# define RL_FILES_CACHE 1
+#endif
+#define RL_FILES_LIST_MAX 1024  /* more matches are counted, not listed */
+
+/* -------------------------------------------------------------------------- */
+/* Directory listing for file name completion. It is read once and used while
+   the directory's mtime stays the same. Entries are
+     type ('d' -- directory, 'f' -- other, '?' -- unknown or a link), name,
+     '/' after a directory's name, 0
+   and are sorted by name. */
+typedef
+struct rl_dir {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	long used;                       /* for LRU replacement, 0 -- empty */
+
+	char *names;
+	char **entries;
+	int count, names_size, entries_size;
+} rl_dir_t;
+
+static rl_dir_t rl_dirs[RL_FILES_CACHE];
+static long rl_dirs_used;
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_files_free()
+{
+	for (int i = 0; i < RL_FILES_CACHE; ++i) {
+		if (rl_dirs[i].names)
+			rl_free(rl_dirs[i].names);
+		if (rl_dirs[i].entries)
+			rl_free(rl_dirs[i].entries);
+	}
+	memset(rl_dirs, 0, sizeof(rl_dirs));
+}
+
+/* -------------------------------------------------------------------------- */
+static int rl_entry_cmp(void const *l, void const *r)
+{
+	return strcmp(*(char const *const*)l + 1, *(char const *const*)r + 1);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Appends an entry to the listing, returns -1 if it could not grow */
+static int rl_dir_add(rl_dir_t *dir, int *top, char const *name, int type)
+{
+	if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+		return 0;
+
+	int length = strlen(name);
+	if (*top + length + 3 > dir->names_size) {
+		int size = dir->names_size ? dir->names_size : 4096;
+		while (*top + length + 3 > size)
+			size *= 2;
+		char *names = rl_realloc(dir->names, size);
+		if (!names)
+			return -1;
+		dir->names = names;
+		dir->names_size = size;
+	}
+
+	char *to = dir->names + *top;
+	*to++ = type == DT_DIR ? 'd' : type == DT_UNKNOWN || type == DT_LNK ? '?' : 'f';
+	memcpy(to, name, length);
+	to += length;
+	if (type == DT_DIR)
+		*to++ = '/';
+	*to++ = 0;
+	*top = to - dir->names;
+	++dir->count;
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Reads all the entries of an open directory and closes it. Linux gives them
+   in big blocks with their types, so no entry is stat()ed. */
+static int rl_dir_read(rl_dir_t *dir, int fd)
+{
+	int top = 0, err = 0;
+	dir->count = 0;
+#if defined(__linux__) && defined(SYS_getdents64)
+	struct rl_dirent64 {
+		unsigned long long d_ino;
+		long long d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+	};
+	char buf[32768];
+	long size;
+	while (!err && (size = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+		for (long pos = 0; pos < size && !err; ) {
+			struct rl_dirent64 *de = (struct rl_dirent64 *)(buf + pos);
+			err = rl_dir_add(dir, &top, de->d_name, de->d_type);
+			pos += de->d_reclen;
+		}
+	close(fd);
+	if (err || size < 0)
+		return -1;
+#else
+	DIR *dp = fdopendir(fd);
+	if (!dp) {
+		close(fd);
+		return -1;
+	}
+	struct dirent *de;
+	while (!err && (de = readdir(dp)))
+		err = rl_dir_add(dir, &top, de->d_name, de->d_type);
+	closedir(dp);
+	if (err)
+		return -1;
+#endif
+
+	if (dir->count + 1 > dir->entries_size) {
+		int size = dir->entries_size ? dir->entries_size : 256;
+		while (dir->count + 1 > size)
+			size *= 2;
+		char **entries = rl_realloc(dir->entries, size * sizeof(entries[0]));
+		if (!entries)
+			return -1;
+		dir->entries = entries;
+		dir->entries_size = size;
+	}
+
+	char *name = dir->names;
+	for (int i = 0; i < dir->count; ++i) {
+		dir->entries[i] = name;
+		name += strlen(name) + 1;
+	}
+	qsort(dir->entries, dir->count, sizeof(dir->entries[0]), rl_entry_cmp);
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Listing of the directory, read again only when it was changed */
+STATIC rl_dir_t *rl_dir_get(char const *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+
+	rl_dir_t *dir = rl_dirs;
+	for (int i = 0; i < RL_FILES_CACHE; ++i) {
+		rl_dir_t *d = rl_dirs + i;
+		if (d->used && d->dev == st.st_dev && d->ino == st.st_ino) {
+			dir = d;
+			break;
+		}
+		if (d->used < dir->used)
+			dir = d;
+	}
+
+	if (dir->used && dir->dev == st.st_dev && dir->ino == st.st_ino &&
+			dir->mtime.tv_sec == st.st_mtim.tv_sec && dir->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		dir->used = ++rl_dirs_used;
+		return dir;
+	}
+
+	dir->used = 0;
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if (rl_dir_read(dir, fd) < 0)
+		return NULL;
+
+	dir->dev = st.st_dev;
+	dir->ino = st.st_ino;
+	dir->mtime = st.st_mtim;
+	dir->used = ++rl_dirs_used;
+	return dir;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Whether the entry matches the typed part of name; dot files match only a
+   dot typed */
+static inline int rl_entry_match(char const *entry, char const *prefix, int length)
+{
+	return !strncmp(entry + 1, prefix, length) && (entry[1] != '.' || (length && prefix[0] == '.'));
+}
+
+/* -------------------------------------------------------------------------- */
+char const *rl_complete_file(char const *start, char const *cur_pos)
+{
+	char const *word = cur_pos, *name = cur_pos;
+	while (word > start && word[-1] != ' ')
+		--word;
+	while (name > word && name[-1] != '/')
+		--name;
+
+	char path[PATH_MAX];
+	if (name - word >= sizeof(path))
+		return NULL;
+	memcpy(path, word, name - word);
+	path[name - word] = 0;
+
+	rl_dir_t *dir = rl_dir_get(name > word ? path : ".");
+	if (!dir)
+		return NULL;
+
+	/* the matching entries are together in the sorted listing */
+	int length = cur_pos - name, lo = 0, hi = dir->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (strncmp(dir->entries[mid] + 1, name, length) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	int first = -1, last = -1, count = 0;
+	for (hi = lo; hi < dir->count && !strncmp(dir->entries[hi] + 1, name, length); ++hi)
+		if (rl_entry_match(dir->entries[hi], name, length)) {
+			if (first < 0)
+				first = hi;
+			last = hi;
+			++count;
+		}
+	if (!count)
+		return NULL;
+
+	static char insert[NAME_MAX + 3];
+	char const *from = dir->entries[first] + 1 + length, *to = dir->entries[last] + 1 + length;
+	int common = 0;
+	while (from[common] && from[common] == to[common])
+		++common;
+
+	if (count == 1) {
+		char const *entry = dir->entries[first];
+		int end = strlen(from), type = entry[0];
+		if (type == '?') { /* a link or a file system without types */
+			struct stat st;
+			if (strlen(path) + strlen(entry + 1) < sizeof(path)) {
+				strcat(path, entry + 1);
+				type = !stat(path, &st) && S_ISDIR(st.st_mode) ? 'd' : 'f';
+			}
+		}
+		snprintf(insert, sizeof(insert), "%.*s%s", end, from,
+			type == 'f' ? " " : type == 'd' && from[end - 1] != '/' ? "/" : "");
+		return insert;
+	}
+
+	if (common) {
+		snprintf(insert, sizeof(insert), "%.*s", common, from);
+		return insert;
+	}
+
+	if (count > RL_FILES_LIST_MAX) {
+		rl_dump_hint("%d files", count);
+		return NULL;
+	}
+
+	char const **options = rl_malloc((count + 1) * sizeof(options[0])), **opt = options;
+	if (!options)
+		return NULL;
+	for (int i = first; i <= last; ++i)
+		if (rl_entry_match(dir->entries[i], name, length))
+			*opt++ = dir->entries[i] + 1;
+	*opt = NULL;
+	rl_dump_options(options);
+	rl_free(options);
+	return NULL;
+}
+
+#ifdef RL_TRACE
+/* -------------------------------------------------------------------------- */
+static unsigned char *trace_put(unsigned char *to, unsigned long value)
+{
+	for (; value >= 0x80; value >>= 7)
+		*to++ = value | 0x80;
+	*to++ = value;
+	return to;
+}
+
+/* -------------------------------------------------------------------------- */
+static void trace_record(int type, unsigned long value, char const *data)
+{
+	if (rl_trace.fd < 0 || rl_trace.replay)
+		return;
+
+	long now = rl_now();
+	unsigned char head[24], *end = head;
+	*end++ = type;
+	end = trace_put(end, now - rl_trace.last);
+	end = trace_put(end, value);
+	rl_trace.last = now;
+
+	struct iovec iov[2] = {
+		{ .iov_base = head, .iov_len = end - head },
+		{ .iov_base = (void *)data, .iov_len = data ? value : 0 }
+	};
+	if (writev(rl_trace.fd, iov, 2) < 0) {
+		syslog(LOG_DEBUG, "readline trace: %m");
+		close(rl_trace.fd);
+		rl_trace.fd = -1;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_trace(char const *file)
+{
+	if (rl_trace.fd >= 0)
+		close(rl_trace.fd);
+	rl_trace.fd = -1;
+	if (!file)
+		return 0;
+
+	int fd = open(file, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+	if (write(fd, RL_TRACE_MAGIC, strlen(RL_TRACE_MAGIC)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	rl_trace.fd = fd;
+	rl_trace.last = rl_now();
+	trace_record('W', rl_window.cols, NULL);
+
+	rl_history_t *h = &rl_state->history;
+	for (int i = 0; i < h->size; ++i)
+		trace_record('H', strlen(h->lines[i]), h->lines[i]);
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned long trace_get(unsigned char const **at)
+{
+	unsigned long value = 0;
+	for (int shift = 0; *at < rl_trace.end && shift < 64; shift += 7) {
+		int byte = *(*at)++;
+		value |= (unsigned long)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			break;
+	}
+	return value;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Steps to the next record, rec.type is 0 at the end of trace */
+static void trace_next()
+{
+	rl_trace_rec_t *rec = &rl_trace.rec;
+	unsigned char const *at = rl_trace.pos = rec->next;
+	rl_trace.part = 0;
+	rec->type = 0;
+	if (at >= rl_trace.end)
+		return;
+
+	int type = *at++;
+	rec->due += trace_get(&at);
+	rec->value = trace_get(&at);
+	rec->data = at;
+	rec->next = at + (type == 'W' ? 0 : rec->value);
+	if (rec->next <= rl_trace.end)
+		rec->type = type; /* else the trace is cut */
+}
+
+/* -------------------------------------------------------------------------- */
+/* Copy of record's bytes as a string, NULL if out of memory */
+static char *trace_string()
+{
+	char *str = rl_malloc(rl_trace.rec.value + 1);
+	if (!str)
+		return NULL;
+	memcpy(str, rl_trace.rec.data, rl_trace.rec.value);
+	str[rl_trace.rec.value] = 0;
+	return str;
+}
+
+/* -------------------------------------------------------------------------- */
+static inline int trace_has_input()
+{
+	return rl_trace.rec.type == 'I' || rl_trace.rec.type == 'W';
+}
+
+/* -------------------------------------------------------------------------- */
+/* rl_input_wait() of a replay. The clock of replay is the trace's one, so
+   timeouts see the same gaps between inputs as were recorded. */
+static int trace_wait(int timeout)
+{
+	if (!trace_has_input())
+		return 0;
+	if (timeout < 0 || rl_trace.rec.due <= rl_trace.clock + timeout)
+		return 1;
+	rl_trace.clock += timeout;
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* rl_read_input() of a replay. Returns the input in the pieces it was read
+   at recording, 0 at the end of the line's input. */
+static int trace_read(char *data, int size, int wait)
+{
+	rl_trace_rec_t *rec = &rl_trace.rec;
+	while (trace_has_input()) {
+		if (!trace_wait(wait))
+			return -1;
+
+		if (rl_trace.timed && rec->due > rl_trace.clock)
+			poll(NULL, 0, rec->due - rl_trace.clock);
+		if (rec->due > rl_trace.clock)
+			rl_trace.clock = rec->due;
+
+		if (rec->type == 'W') {
+			rl_trace.cols = rec->value;
+			trace_next();
+			rl_update_window();
+			continue;
+		}
+
+		unsigned long count = rec->value - rl_trace.part;
+		if (count > size)
+			count = size;
+		memcpy(data, rec->data + rl_trace.part, count);
+		rl_trace.part += count;
+		if (rl_trace.part >= rec->value)
+			trace_next();
+		return count;
+	}
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_replay(char const *file, int timed, int out_fd)
+{
+	int fd = open(file, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	unsigned char *trace = NULL;
+	int size = 0, count = 0, magic = strlen(RL_TRACE_MAGIC);
+	if (!fstat(fd, &st) && (trace = rl_malloc(st.st_size + 1)))
+		while (size < st.st_size && (count = safe_read(fd, (char *)trace + size, st.st_size - size)) > 0)
+			size += count;
+	close(fd);
+	if (size < magic || memcmp(trace, RL_TRACE_MAGIC, magic)) {
+		if (trace)
+			rl_free(trace);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the output of editor goes to out_fd */
+	rl_out_purge();
+	fflush(stdout);
+	int stdout_fd = dup(STDOUT_FILENO);
+	dup2(out_fd, STDOUT_FILENO);
+
+	rl_state_t *s = rl_state;
+	char const *history_file = s->history.file;
+	int cols = rl_window.cols;
+	s->history.file = NULL; /* not saved from here */
+	history_empty();
+	s->in_pos = s->in_top = 0;
+	memset(&s->tok, 0, sizeof(s->tok));
+
+	rl_trace.end = trace + size;
+	rl_trace.rec.next = trace + magic;
+	rl_trace.rec.due = rl_trace.clock = 0;
+	rl_trace.cols = cols;
+	rl_trace.timed = timed;
+	rl_trace.replay = 1;
+	trace_next();
+
+	int lines = 0;
+	while (rl_trace.rec.type) {
+		char *str = NULL, *prompt = NULL;
+		int lost;
+		switch (rl_trace.rec.type) {
+		case 'W':
+			rl_window.cols = rl_trace.cols = rl_trace.rec.value;
+			s->cols_valid = 0;
+			break;
+
+		case 'H':
+			if ((str = trace_string()))
+				history_add(str);
+			break;
+
+		case 'L':
+			lost = !(prompt = trace_string());
+			trace_next();
+			if (rl_trace.rec.type == 'S') {
+				lost |= !(str = trace_string());
+				trace_next();
+			}
+			if (!lost) { /* else the line's input records are skipped */
+				readline(prompt, str);
+				++lines;
+			}
+			if (prompt)
+				rl_free(prompt);
+			if (str)
+				rl_free(str);
+			continue;
+		}
+		if (str)
+			rl_free(str);
+		trace_next();
+	}
+
+	rl_trace.replay = 0;
+	rl_free(trace);
+	s->history.file = history_file;
+	rl_window.cols = cols;
+	s->cols_valid = 0;
+
+	rl_out_purge();
+	fflush(stdout);
+	dup2(stdout_fd, STDOUT_FILENO);
+	close(stdout_fd);
+	return lines;
+}
+#else
+static inline void trace_record(int type, unsigned long value, char const *data) {}
+#endif
+
+/* -------------------------------------------------------------------------- */
+STATIC int rl_input_wait(int timeout)
+{
+#ifdef RL_TRACE
+	if (rl_trace.replay)
+		return trace_wait(timeout);
+#endif
+	struct pollfd pfd = { .fd = RL_IN, .events = POLLIN };
+	return poll(&pfd, 1, timeout) > 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* ms to hold queued messages back (-1 - there are none), so that a burst of
+   them is shown with one redraw per RL_FRAME_INTERVAL */
+STATIC int rl_messages_delay()
+{
+	if (!__atomic_load_n(&rl_messages, __ATOMIC_RELAXED) || rl_state->remote)
+		return -1;
+#ifdef RL_FRAME_INTERVAL
+	long delay = rl_state->last_messages + RL_FRAME_INTERVAL - rl_now();
+	return delay > 0 ? delay : 0;
+#else
+	return 0;
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+/* Prints the queued messages above the line being edited and draws the
+   prompt and the line again below them */
+STATIC void rl_messages_show()
+{
+	rl_state_t *s = rl_state;
+	rl_message_t *msg = rl_messages_take();
+	s->last_messages = rl_now();
+	if (!msg)
+		return;
+
+	if (s->in_linemode) { /* the typed text is kept by the terminal, unseen */
+		rl_out("\n", 1);
+		rl_messages_out(msg, 0);
+		rl_out(s->prompt, strlen(s->prompt));
+		rl_out_purge();
+		return;
+	}
+
+	rl_sgr_reset();
+	rl_move(s->shown_col, 0);
+	rl_out(CLEAR_EOS, strlen(CLEAR_EOS));
+	rl_messages_out(msg, 1);
+	rl_out(s->prompt, strlen(s->prompt));
+	rl_invalidate(0);
+	rl_render();
+	rl_out_purge();
+}
+
+/* -------------------------------------------------------------------------- */
+/* Time the line is given up at by readline_timed() or 0 */
+STATIC long rl_expires()
+{
+	rl_state_t *s = rl_state;
+	long expires = s->deadline;
+	if (s->idle > 0 && (!expires || s->last_input + s->idle < expires))
+		expires = s->last_input + s->idle;
+	return expires;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Waits up to `wait` ms (-1 - forever) for some input, changes of window
+   size and queued messages are handled meanwhile. Returns count of bytes
+   read, 0 at EOF, -1 if nothing came in time; `timed_out` is set when the
+   time of readline_timed() is over. */
+STATIC int rl_read_input(char *data, int size, int wait)
+{
+#ifdef RL_TRACE
+	if (rl_trace.replay) {
+		int count = trace_read(data, size, wait);
+		if (count >= 0)
+			rl_state->last_input = rl_now();
+		return count;
+	}
+#endif
+	long expires = rl_expires(), deadline = wait < 0 ? 0 : rl_now() + wait;
+	if (expires && (!deadline || expires < deadline))
+		deadline = expires;
+	for (;;) {
+		int timeout = rl_window_timeout();
+		if (!timeout) {
+			int cols = rl_window.cols;
+			rl_update_window();
+			if (rl_window.cols != cols)
+				trace_record('W', rl_window.cols, NULL);
+			continue;
+		}
+
+		int delay = rl_messages_delay();
+		if (!delay) {
+			rl_messages_show();
+			continue;
+		}
+		if (delay > 0 && (timeout < 0 || delay < timeout))
+			timeout = delay;
+
+		if (deadline) {
+			long left = deadline - rl_now();
+			if (left < 0)
+				left = 0; /* still look if something is there */
+			if (timeout < 0 || left < timeout)
+				timeout = left;
+		}
+
+		struct pollfd pfd[3] = {
+			{ .fd = RL_IN, .events = POLLIN },
+			{ .fd = rl_notify[0], .events = POLLIN },
+			{ .fd = RL_OUT, .events = POLLOUT }
+		};
+		if (poll(pfd, rl_out_pending() ? 3 : 2, timeout) < 0 && errno != EINTR)
+			break;
+
+		if (pfd[2].revents) {
+			rl_out_purge();
+			if (rl_out_failed())
+				return 0;
+			if (rl_state->frame_due && !rl_out_pending())
+				rl_frame();
+		}
+		if (pfd[1].revents)
+			rl_notified();
+		if (pfd[0].revents)
+			break;
+
+		if (deadline && rl_now() >= deadline) {
+			rl_state->timed_out = expires && deadline == expires;
+			return -1;
+		}
+	}
+
+	int count = safe_read(RL_IN, data, size);
+	if (count < 0)
+		return -1; /* taken by someone else */
+	trace_record('I', count, data);
+	rl_state->last_input = rl_now();
+	return count;
+}
+
+/* -------------------------------------------------------------------------- */
+/* ms to hold the next frame back: a terminal that does not drain its output
+   gets at most one frame per RL_FRAME_INTERVAL */
+STATIC int rl_frame_delay()
+{
+#ifdef RL_FRAME_INTERVAL
+	struct pollfd pfd = { .fd = RL_OUT, .events = POLLOUT };
+	if (poll(&pfd, 1, 0) > 0)
+		return 0;
+
+	long delay = rl_state->last_frame + RL_FRAME_INTERVAL - rl_now();
+	return delay > 0 ? delay : 0;
+#else
+	return 0;
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+STATIC void rl_frame()
+{
+	rl_out_purge();
+	rl_state->frame_due = rl_out_pending() > 0;
+	if (rl_state->frame_due)
+		return; /* the terminal is slow, the next frame draws all the edits */
+
+	int delay = rl_frame_delay();
+	if (delay && rl_state->stepping) {
+		rl_state->frame_due = 1; /* readline_step() gives the delay to the caller */
+		rl_state->frame_at = rl_now() + delay;
+		return;
+	}
+	if (delay && rl_input_wait(delay))
+		return; /* more input is coming, draw it all at once later */
+
+	rl_render();
+	rl_out_purge();
+	rl_state->last_frame = rl_now();
+	rl_state->frame_at = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Reads a line edited by the terminal, waiting up to `wait` ms (-1 --
+   forever). Returns the char that finished it: '\n', '\t' or '\033'; 0 when
+   it was pushed with Ctrl-D; -1 at EOF; -2 when nothing came in time. */
+STATIC int rl_line_read(int wait)
+{
+	char *raw = rl_state->raw;
+	int count = rl_read_input(raw, sizeof(rl_state->raw) - 1, wait);
+	if (count < 0 && !rl_state->timed_out)
+		return -2;
+	if (count <= 0)
+		return -1;
+
+	int end = (unsigned char)raw[count - 1];
+	if (end == '\n' || end == '\t' || end == '\033')
+		--count;
+	else
+		end = 0;
+
+	raw[count] = 0;
+	rl_set_text(raw);
+	return end;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Takes the line over from the terminal in character mode. The cursor is
+   behind the echo of the line and of the key that finished it. */
+STATIC void rl_line_takeover(int end)
+{
+	int col = rl_col(rl_state->length);
+	if (end == '\t')
+		col += 8 - col % 8;
+	else
+		if (end)
+			col += 2; /* ^[ */
+
+	rl_term_raw();
+	rl_state->in_linemode = 0;
+	if (rl_window.cols) { /* echo of keys typed after Esc could move it further */
+		rl_out(CUR_HOME, 1);
+		col -= col % rl_window.cols;
+	}
+	rl_move(col, 0);
+	rl_out(rl_state->prompt, strlen(rl_state->prompt));
+	rl_out(CLEAR_EOS PASTE_ON, strlen(CLEAR_EOS PASTE_ON));
+	rl_invalidate(0);
+
+	if (end) { /* process the key in character mode */
+		rl_state->input[0] = end;
+		rl_state->in_pos = 0;
+		rl_state->in_top = 1;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* A byte of pasted text: line ends and tabs become spaces (CR LF -- one),
+   other control bytes are dropped */
+static void rl_paste_put(int ch)
+{
+	rl_state_t *s = rl_state;
+	int prev = s->paste_prev;
+	s->paste_prev = ch;
+	if (ch == '\t' || ch == '\r' || (ch == '\n' && prev != '\r'))
+		ch = ' ';
+	else
+		if (ch < ' ' || ch == 0x7F)
+			return;
+
+	if (s->paste_length < sizeof(s->paste) - 1)
+		s->paste[s->paste_length++] = ch;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Inserts the text pasted so far as one edit */
+STATIC void rl_paste_end()
+{
+	rl_state_t *s = rl_state;
+	s->paste[s->paste_length] = 0;
+	s->pasting = s->paste_length = s->paste_matched = s->paste_prev = 0;
+	rl_insert_seq(s->paste, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Takes the input of a bracketed paste up to its end mark. The text and the
+   part of the mark matched are kept in the state, so a paste coming in
+   pieces is taken as the pieces come. Returns 1 when the paste is over. */
+STATIC int rl_paste()
+{
+	rl_state_t *s = rl_state;
+	static const char mark[] = PASTE_END;
+
+	while (s->paste_matched < sizeof(mark) - 1) {
+		if (s->in_pos >= s->in_top)
+			return 0;
+
+		int ch = (unsigned char)s->input[s->in_pos++];
+		if (ch == mark[s->paste_matched]) {
+			++s->paste_matched;
+			continue;
+		}
+
+		for (int i = 0; i < s->paste_matched; ++i)
+			rl_paste_put(mark[i]);
+		s->paste_matched = ch == mark[0];
+		if (!s->paste_matched)
+			rl_paste_put(ch);
+	}
+
+	rl_paste_end();
+	return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_batch(char const **line)
+{
+	rl_state_t *s = rl_state;
+	for (;;) {
+		char *start = s->batch + s->batch_pos;
+		char *eol = s->batch_scan < s->batch_top ?
+			memchr(s->batch + s->batch_scan, '\n', s->batch_top - s->batch_scan) : NULL;
+		if (eol || (s->batch_eof && s->batch_pos < s->batch_top)) {
+			if (!eol)
+				eol = s->batch + s->batch_top; /* the last line without \n */
+			s->batch_pos = s->batch_scan = eol - s->batch + (eol < s->batch + s->batch_top);
+			if (eol > start && eol[-1] == '\r')
+				--eol;
+			*eol = 0;
+			*line = start;
+			return eol - start;
+		}
+		s->batch_scan = s->batch_top;
+
+		if (s->batch_eof)
+			return -1;
+
+		if (s->batch_pos) { /* a part of line is left, move it to the start */
+			s->batch_top -= s->batch_pos;
+			s->batch_scan -= s->batch_pos;
+			memmove(s->batch, start, s->batch_top);
+			s->batch_pos = 0;
+		}
+
+		if (s->batch_top + 1 >= s->batch_size) { /* the line does not fit */
+			int size = s->batch_size ? s->batch_size * 2 : RL_BATCH_BUFFER;
+			char *batch = rl_realloc(s->batch, size);
+			if (!batch)
+				return -1;
+			s->batch = batch;
+			s->batch_size = size;
+		}
+
+		int count = safe_read(RL_IN, s->batch + s->batch_top, s->batch_size - s->batch_top - 1);
+		if (count < 0) {
+			struct pollfd pfd = { .fd = RL_IN, .events = POLLIN };
+			poll(&pfd, 1, -1);
+		} else
+		if (count > 0)
+			s->batch_top += count;
+		else
+			s->batch_eof = 1;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+void readline_highlight(rl_highlight_fn *fn, char const * const *styles)
+{
+	rl_state_t *s = rl_state;
+	s->_highlight = fn;
+	s->styles = styles;
+	for (s->styles_count = 0; styles && styles[s->styles_count]; ++s->styles_count)
+		;
+	memset(s->attr, 0, sizeof(s->attr));
+	s->drawn = 0;
+	s->hl_from = 0;
+	s->hl_to = s->length;
+}
+
+/* -------------------------------------------------------------------------- */
+void readline_suggest(int on)
+{
+	rl_history_t *h = &rl_state->history;
+	if (!on) {
+		if (h->trie)
+			rl_free(h->trie);
+		h->trie = NULL;
+		h->trie_size = h->trie_free = 0;
+		return;
+	}
+
+	if (h->trie || trie_grow(h) < 0)
+		return;
+	for (int i = 0; i < h->size; ++i)
+		trie_add(h, h->lines[i], h->meta[i].id);
+}
+
+/* -------------------------------------------------------------------------- */
+void readline_linemode(int on)
+{
+	rl_state->linemode = on;
+}
+
+/* -------------------------------------------------------------------------- */
+void readline_keep_raw(int on)
+{
+	rl_state->keep_raw = on;
+	if (!on)
+		readline_pause();
+}
+
+/* -------------------------------------------------------------------------- */
+/* Takes the keys typed ahead into the input buffer, the terminal would
+   give them to a command run next */
+STATIC void rl_typeahead()
+{
+	rl_state_t *s = rl_state;
+	if (s->in_pos) {
+		memmove(s->input, s->input + s->in_pos, s->in_top - s->in_pos);
+		s->in_top -= s->in_pos;
+		s->in_pos = 0;
+	}
+
+	struct pollfd pfd = { .fd = RL_IN, .events = POLLIN };
+	while (s->in_top < sizeof(s->input) && poll(&pfd, 1, 0) > 0) {
+		int count = safe_read(RL_IN, s->input + s->in_top, sizeof(s->input) - s->in_top);
+		if (count <= 0)
+			break;
+		trace_record('I', count, s->input + s->in_top);
+		s->in_top += count;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+void readline_pause()
+{
+	if (!in_raw || rl_state->remote)
+		return;
+	rl_typeahead();
+	if (!tcsetattr(STDOUT_FILENO, TCSANOW, &term_old)) {
+		in_raw = 0;
+		paused = 1;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* Shows the prompt and the initial line */
+STATIC void rl_begin(char const *prompt, char const *string)
+{
+	rl_state->raw[0] = 0;
+	rl_state->line[0] = 0;
+	rl_state->length = rl_state->cur_pos = rl_state->finish = rl_state->echoed = 0;
+	rl_state->pasting = rl_state->paste_length = rl_state->paste_matched = rl_state->paste_prev = 0;
+	rl_state->eof = 0;
+	rl_state->hl_from = rl_state->hl_to = 0; /* an empty line can be an error too */
+	rl_state->last_input = rl_now();
+	rl_state->timed_out = 0;
+	rl_prompt_t *compiled = prompt ? NULL : rl_state->compiled;
+	if (compiled) {
+		rl_prompt_take(compiled);
+		prompt = compiled->text;
+	} else
+		if (!prompt)
+			prompt = "";
+	rl_state->prompt = prompt;
+	rl_state->prompt_width = compiled ? compiled->width : utf8_width(prompt);
+
+	rl_messages_print(0);
+	trace_record('L', strlen(prompt), prompt);
+	if (string)
+		trace_record('S', strlen(string), string);
+
+	/* the line goes to the terminal unless something is typed ahead */
+	rl_state->in_linemode = rl_state->linemode && !string &&
+		rl_state->in_pos >= rl_state->in_top && !rl_term_mode(1);
+	if (!rl_state->in_linemode)
+		rl_term_raw();
+//	char const *term = getenv("TERM");
+//	rl_printf("width=%u; term=%s\n\r%s", rl_window.cols, term ?: "unknown", SET_WRAP_MODE);
+	rl_printf("%s%s", rl_state->in_linemode ? "" : PASTE_ON, prompt);
+	rl_invalidate(0);
+
+	if (string)
+		rl_set_text(string);
+	undo_reset();
+
+	rl_frame();
+}
+
+/* -------------------------------------------------------------------------- */
+/* Applies the input as it comes, waiting up to `wait` ms (-1 -- forever) for
+   more of it. Returns 1 when the line is finished, 0 when no input came in
+   time. */
+STATIC int rl_step(int wait)
+{
+	rl_state_t *s = rl_state;
+	if (s->in_linemode && !s->finish) {
+		int end = rl_line_read(wait);
+		if (end == -2)
+			return 0;
+		if (end == '\n')
+			s->echoed = s->finish = 1;
+		else
+			if (end < 0)
+				s->eof = s->finish = 1;
+			else
+				rl_line_takeover(end);
+	}
+
+	while (!s->finish) {
+		if (rl_out_failed()) {
+			s->eof = 1;
+			break;
+		}
+		if (s->in_pos >= s->in_top) {
+			/* all the input we have is applied, show the result */
+			if (!rl_input_wait(0))
+				rl_frame();
+
+			/* Esc alone or the start of a sequence? */
+			int left = wait;
+			if (s->tok.state != TK_GROUND) {
+				left = s->last_input + RL_ESC_TIMEOUT - rl_now();
+				if (left < 0)
+					left = 0;
+				if (wait >= 0 && wait < left)
+					left = wait;
+			}
+			int count = rl_read_input(s->input, sizeof(s->input), left);
+			if (s->timed_out)
+				break;
+			if (count < 0) {
+				if (s->tok.state == TK_GROUND || rl_now() < s->last_input + RL_ESC_TIMEOUT)
+					return 0;
+				char const *seq = rl_tok_flush();
+				if (seq)
+					rl_exec_seq(seq);
+				continue;
+			}
+			if (!count) {
+				if (s->pasting)
+					rl_paste_end();
+				s->eof = 1;
+				break;
+			}
+			s->in_pos = 0;
+			s->in_top = count;
+		}
+
+		if (s->pasting) {
+			STAT_START(started);
+			if (rl_paste())
+				STAT_TIME(rl_key_stats + RL_STAT_PASTE, started);
+			continue;
+		}
+
+		int ch = (unsigned char)s->input[s->in_pos++];
+		if (ch >= ' ' && ch < 0x7F && s->tok.state == TK_GROUND) {
+			STAT_START(started);
+			if (rl_append_fast(ch)) {
+				STAT_TIME(rl_key_stats + RL_STAT_INSERT, started);
+				continue;
+			}
+		}
+		do {
+			char const *seq = rl_tok_feed(&ch);
+			if (!seq)
+				continue;
+
+			if (!strcmp(seq, PASTE_BEGIN)) {
+				s->pasting = 1; /* the text follows */
+				break;
+			}
+			rl_exec_seq(seq);
+		} while (ch >= 0 && !s->finish);
+	}
+	return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Moves to the next line and gives the terminal back */
+STATIC char *rl_end()
+{
+	if (!rl_state->echoed) {
+		rl_state->finish = 1; /* at EOF too, no suggestion is taken */
+		rlc_cursor_end();
+		rl_render();
+		rl_out(PASTE_OFF, strlen(PASTE_OFF));
+	}
+	gtoutf8(rl_state->raw, rl_state->line, -1);
+	
+	if (!rl_state->keep_raw)
+		rl_term_unraw();
+	rl_state->in_linemode = 0;
+	if (!rl_state->timed_out)
+		history_add(rl_state->raw);
+	if (!rl_state->echoed)
+		rl_printf(rl_state->remote ? "\r\n" : "\n");
+	rl_out_purge();
+	return rl_state->raw;
+}
+
+/* -------------------------------------------------------------------------- */
+char *readline(char const *prompt, char const *string)
+{
+#ifdef RL_TRACE
+	if (!rl_trace.replay)
+#endif
+	if (!rl_state->remote && !isatty(RL_IN)) {
+		char const *line;
+		return readline_batch(&line) < 0 ? NULL : (char *)line;
+	}
+
+	rl_state->stepping = 0;
+	rl_begin(prompt, string);
+	while (!rl_step(-1))
+		;
+	char *line = rl_end();
+	rl_out_drain();
+	return line;
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_start(char const *prompt, char const *string)
+{
+	if (!rl_state->remote && !isatty(RL_IN))
+		return -1;
+
+	rl_state->stepping = 1;
+	rl_begin(prompt, string);
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* The shorter of two waits, -1 -- forever */
+static inline int rl_wait_min(int a, int b)
+{
+	return a < 0 || (b >= 0 && b < a) ? b : a;
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_step(char **line, int *wait)
+{
+	rl_state_t *s = rl_state;
+	rl_prompt_update(); /* the notice may be taken by another session */
+	if (!rl_step(0)) {
+		long now = rl_now(), expires = rl_expires();
+		int next = rl_wait_min(rl_window_timeout(), rl_messages_delay());
+		long esc = s->last_input + RL_ESC_TIMEOUT - now;
+		if (s->tok.state != TK_GROUND)
+			next = rl_wait_min(next, esc > 0 ? esc : 0);
+		if (expires)
+			next = rl_wait_min(next, expires > now ? expires - now : 0);
+		if (s->frame_due && s->frame_at)
+			next = rl_wait_min(next, s->frame_at > now ? s->frame_at - now : 0);
+		*wait = next;
+		return RL_AGAIN;
+	}
+
+	*line = rl_end();
+	if (s->eof)
+		return -1;
+	return s->timed_out ? RL_TIMEOUT : (int)strlen(*line);
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_flush()
+{
+	rl_out_purge();
+	return rl_out_failed() ? -1 : rl_out_pending();
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_notify_fd()
+{
+	return rl_notify[0];
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_in_fd()
+{
+	return RL_IN;
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_out_fd()
+{
+	return RL_OUT;
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_write(char const *data, int size)
+{
+	rl_out(data, size);
+	return readline_flush();
+}
+
+/* -------------------------------------------------------------------------- */
+int readline_timed(char const *prompt, char const *string, int idle, long deadline, char **line)
+{
+	rl_state_t *s = rl_state;
+	s->idle = idle;
+	s->deadline = deadline;
+	char *text = readline(prompt, string);
+	s->idle = 0;
+	s->deadline = 0;
+	if (!text)
+		return -1;
+
+	*line = text;
+	return s->timed_out ? RL_TIMEOUT : (int)strlen(text);
+}
+
+#ifdef RL_TEST
+/* -------------------------------------------------------------------------- */
+char *readline_test(char const *prompt, char const *string)
+{
+	if (!isatty(STDIN_FILENO)) {
+		char const *line;
+		return readline_batch(&line) < 0 ? NULL : (char *)line;
+	}
+
+	rl_state->raw[0] = 0;
+	rl_state->line[0] = 0;
+	rl_state->length = rl_state->cur_pos = rl_state->finish = 0;
 
-	rl_state->raw[0] = 0;
-	rl_state->line[0] = 0;
-	rl_state->length = rl_state->cur_pos = rl_state->finish = 0;
-
 	rl_term_raw();
 	rl_printf("%s%s", SET_WRAP_MODE, prompt);
 
+	rl_invalidate(0);
 	if (string)
-		rl_set_text(string, 1);
+		rl_set_text(string);
+	rl_render();
 
 	int rdn;
-	char ch, seq[12], *seqpos = seq;
-	while ((rdn = read(STDIN_FILENO, &ch, 1)) > 0) {
-		if (seqpos >= seq + sizeof(seq))
-			seqpos = seq; /* wrong sequence -- wrong reaction :) */
-		*seqpos++ = ch;
-		*seqpos = 0;
-		if (!skip_char_seq(seq))
-			continue; /* wrong seq */
+	unsigned char byte;
+	char const *seq = NULL;
+	while ((rdn = read(STDIN_FILENO, &byte, 1)) > 0) {
+		int ch = byte;
+	_next_tok:
+		if (!(seq = rl_tok_feed(&ch))) {
+			if (ch >= 0)
+				goto _next_tok;
+			continue; /* not finished seq */
+		}
 
 /*		if (rl_exec_seq(seq))
 			break; /* finish */
 
-		seqpos = seq;
-
 		char str[128], *out = str;
 		out += snprintf(out, sizeof(str) - (out-str), "\n\r", rdn);
-		char *in = seq;
+		char const *in = seq;
 		while (*in) {
 			char ch = *in++;
 			out += snprintf(out , sizeof(str) - (out - str), !(ch & -32) ? "\\%03o" : "%c", ch);
@@ -1185,7 +4540,7 @@ char *readline_test(char const *prompt, char const *string)
 
 		out += snprintf(out, sizeof(str) - (out-str), " : ");
 		rl_glyph_t ucs[16], *uc = ucs;
-		rl_glyph_t *ucend = utf8tog(ucs, seq);
+		rl_glyph_t *ucend = utf8tog(ucs, seq, countof(ucs) - 1);
 		while (uc < ucend) {
 			out += snprintf(out, sizeof(str) - (out-str), "%04X ", *uc++);
 		}
@@ -1202,6 +4557,8 @@ char *readline_test(char const *prompt, char const *string)
 		rl_out(str, out - str);//*/
 		if (seq[0] == 3)
 			break;
+		if (ch >= 0)
+			goto _next_tok;
 	}
 
 	gtoutf8(rl_state->raw, rl_state->line, -1);
@@ -25,21 +25,114 @@ SOFTWARE.
 #ifndef READLINE_H_
 #define READLINE_H_
 
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* -------------------------------------------------------------------------- */
 typedef
 char const *(rl_get_completion_fn)(char const *start, char const *cur_pos);
 
+typedef
+struct rl_span {
+	int start, end;   /* bytes of the line */
+	int style;        /* 1.. -- index in styles of readline_highlight() + 1, 0 -- default */
+} rl_span_t;
+
+typedef
+int (rl_highlight_fn)(char const *line, int from, int to, rl_span_t *spans, int max_spans);
+
 void rl_dump_options(char const * const *options);
 void rl_dump_hint(char const *fmt, ...);
+char const *rl_complete_file(char const *start, char const *cur_pos);
+int rl_print_async(char const *fmt, ...);
 
-void readline_init(rl_get_completion_fn *gc);
+typedef struct rl_prompt rl_prompt_t;
+
+rl_prompt_t *rl_prompt_new(char const *format);
+int rl_prompt_set(rl_prompt_t *prompt, char const *name, char const *text);
+void rl_prompt_free(rl_prompt_t *prompt);
+
+typedef
+struct rl_allocator {
+	void *(*malloc)(void *ctx, size_t size);
+	void *(*realloc)(void *ctx, void *ptr, size_t size);
+	void (*free)(void *ctx, void *ptr);
+	void *ctx;
+} rl_allocator_t;
+
+void readline_allocator(rl_allocator_t const *allocator);
+
+int readline_init(rl_get_completion_fn *gc);
 void readline_free();
 
+typedef struct rl_session rl_session_t;
+
+rl_session_t *readline_session_new(int in_fd, int out_fd, int cols);
+rl_session_t *readline_session(rl_session_t *session);
+void readline_session_free(rl_session_t *session);
+
 void readline_history_load(char const *file);
+int readline_history_top(char const *prefix, char const **lines, int max);
+void readline_linemode(int on);
+void readline_suggest(int on);
+void readline_keep_raw(int on);
+void readline_prompt(rl_prompt_t *prompt);
+void readline_pause();
+void readline_highlight(rl_highlight_fn *fn, char const * const *styles);
 
 char *readline(char const *prompt, char const *string);
+#define RL_TIMEOUT (-2)
+int readline_timed(char const *prompt, char const *string, int idle, long deadline, char **line);
+#define RL_AGAIN (-3)
+int readline_start(char const *prompt, char const *string);
+int readline_step(char **line, int *wait);
+int readline_flush();
+int readline_notify_fd(); /* poll it with the terminal, then readline_step() */
+int readline_in_fd();     /* of the current session */
+int readline_out_fd();
+int readline_write(char const *data, int size);
+int readline_batch(char const **line);
+#ifdef RL_STATS
+#define RL_STATS_BUCKETS 24
+
+typedef
+struct rl_histogram {
+	unsigned long count, total_us, max_us;
+	unsigned long buckets[RL_STATS_BUCKETS]; /* [i] -- under 2^i us, the last -- the rest */
+} rl_histogram_t;
+
+typedef
+struct rl_stats {
+	unsigned long bytes_read, reads;         /* read() calls */
+	unsigned long bytes_written, writes;     /* write() calls */
+	unsigned long flushes;                   /* output buffer purges */
+	unsigned long full_redraws, partial_redraws, cursor_moves;
+	unsigned long history_adds, history_evictions;
+	unsigned long completions;
+	rl_histogram_t completion;               /* completion function latency */
+} rl_stats_t;
+
+typedef
+void (rl_stats_key_fn)(char const *key, rl_histogram_t const *latency, void *ctx);
+
+rl_stats_t const *rl_stats();
+void rl_stats_keys(rl_stats_key_fn *fn, void *ctx);
+void rl_stats_reset();
+#endif
+
+#ifdef RL_TRACE
+int readline_trace(char const *file);
+int readline_replay(char const *file, int timed, int out_fd);
+#endif
 #ifdef RL_TEST
 char *readline_test(char const *prompt, char const *string);
 #endif
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* READLINE_H_ */
@@ -0,0 +1,224 @@
+/* MIT License
+
+Copyright (c) 2010 Vladimir Antonov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef READLINE_HPP_
+#define READLINE_HPP_
+
+/* C++20 binding: RAII session and co_await of lines */
+
+#include <coroutine>
+#include <functional>
+#include <new>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <time.h>
+
+#include "readline.h"
+
+namespace rl {
+
+/* -------------------------------------------------------------------------- */
+/* Result of a read: the line stays in the editor buffer, the view is valid up
+   to the next read. */
+struct line {
+	int status;             /* length, -1 -- end of input, RL_TIMEOUT */
+	std::string_view text;
+
+	explicit operator bool() const { return status >= 0; }
+};
+
+/* -------------------------------------------------------------------------- */
+/* Waits for fd readiness with poll(). Any loop with the same wait() can drive
+   session::read_line(): `fn` is called once when one of `fds` is ready for
+   its events or after `timeout` ms (-1 -- no timeout). */
+class poll_loop {
+public:
+	void wait(std::vector<pollfd> fds, int timeout, std::function<void()> fn)
+	{
+		waits_.push_back({ std::move(fds), timeout < 0 ? -1 : now() + timeout, std::move(fn) });
+	}
+
+	void wait(int fd, int timeout, std::function<void()> fn, short events = POLLIN)
+	{
+		wait(std::vector<pollfd> { { fd, events, 0 } }, timeout, std::move(fn));
+	}
+
+	/* Runs until nothing waits */
+	void run()
+	{
+		while (!waits_.empty())
+			run_once();
+	}
+
+	void run_once()
+	{
+		std::vector<pollfd> pfd;
+		long first = -1;
+		for (auto &w : waits_) {
+			pfd.insert(pfd.end(), w.fds.begin(), w.fds.end());
+			if (w.until >= 0 && (first < 0 || w.until < first))
+				first = w.until;
+		}
+
+		long timeout = first < 0 ? -1 : first - now();
+		poll(pfd.data(), pfd.size(), timeout < 0 && first >= 0 ? 0 : timeout);
+
+		std::vector<std::function<void()>> ready;
+		long t = now();
+		size_t end = pfd.size();
+		for (size_t i = waits_.size(); i--; ) {
+			size_t start = end - waits_[i].fds.size();
+			bool fired = waits_[i].until >= 0 && waits_[i].until <= t;
+			for (size_t k = start; k < end; ++k)
+				fired = fired || pfd[k].revents;
+			end = start;
+			if (fired) {
+				ready.push_back(std::move(waits_[i].fn));
+				waits_.erase(waits_.begin() + i);
+			}
+		}
+		for (auto it = ready.rbegin(); it != ready.rend(); ++it)
+			(*it)(); /* may add new waits */
+	}
+
+private:
+	struct entry {
+		std::vector<pollfd> fds;
+		long until; /* ms or -1 */
+		std::function<void()> fn;
+	};
+	std::vector<entry> waits_;
+
+	static long now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+	}
+};
+
+/* -------------------------------------------------------------------------- */
+/* The editor state is one per process, so is the session */
+class session {
+public:
+	explicit session(rl_get_completion_fn *gc = nullptr)
+	{
+		if (readline_init(gc) < 0)
+			throw std::bad_alloc();
+	}
+	~session() { readline_free(); }
+
+	session(session const &) = delete;
+	session &operator=(session const &) = delete;
+
+	/* Blocking read */
+	line read(char const *prompt, char const *init = nullptr)
+	{
+		char *text = ::readline(prompt, init);
+		if (!text)
+			return { -1, {} };
+		std::string_view view(text);
+		return { (int)view.size(), view };
+	}
+
+	template <class Loop>
+	class line_awaiter {
+	public:
+		line_awaiter(Loop &loop, char const *prompt, char const *init)
+			: loop_(loop), prompt_(prompt), init_(init) {}
+
+		bool await_ready()
+		{
+			if (readline_start(prompt_, init_) < 0) { /* not a terminal */
+				char const *text;
+				result_.status = readline_batch(&text);
+				if (result_.status >= 0)
+					result_.text = text;
+				return true;
+			}
+			return step();
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			handle_ = handle;
+			arm();
+		}
+
+		line await_resume() { return result_; }
+
+	private:
+		Loop &loop_;
+		char const *prompt_, *init_;
+		std::coroutine_handle<> handle_;
+		line result_ { RL_AGAIN, {} };
+		int wait_ = -1;
+		bool done_ = false;
+
+		bool step()
+		{
+			if (!done_) {
+				char *text;
+				result_.status = readline_step(&text, &wait_);
+				if (result_.status == RL_AGAIN)
+					return false;
+				result_.text = text;
+				done_ = true;
+				wait_ = -1;
+			}
+			return readline_flush() <= 0; /* the line is out before the caller writes */
+		}
+
+		/* Queued output goes first, no keys are taken meanwhile. Notices of
+		   rl_print_async(), rl_prompt_set() and resizes come meanwhile too. */
+		void arm()
+		{
+			bool out = readline_flush() > 0;
+			std::vector<pollfd> fds { { out ? readline_out_fd() : readline_in_fd(), short(out ? POLLOUT : POLLIN), 0 } };
+			if (readline_notify_fd() >= 0)
+				fds.push_back({ readline_notify_fd(), POLLIN, 0 });
+			loop_.wait(std::move(fds), wait_, [this] {
+				if (step())
+					handle_.resume();
+				else
+					arm();
+			});
+		}
+	};
+
+	/* co_await session.read_line(loop, "> ") edits the line as the input
+	   comes, the coroutine goes on when it is entered */
+	template <class Loop>
+	line_awaiter<Loop> read_line(Loop &loop, char const *prompt, char const *init = nullptr)
+	{
+		return { loop, prompt, init };
+	}
+};
+
+} /* namespace rl */
+
+#endif /* READLINE_HPP_ */
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""Generates rl_width.h -- display widths of unicode code points.
+
+	python3 tools/rl_width.py > rl_width.h
+
+Planes 0 and 1 are split into 128 code point blocks, each block is stored
+once as 2 bits per code point (0, 1 or 2 columns). Planes 2 and 3 are wide,
+variation selectors of plane 14 have no width, the rest is narrow.
+"""
+
+import sys
+import unicodedata
+
+BLOCK = 128
+LIMIT = 0x20000
+
+
+def width(cp):
+	ch = chr(cp)
+	cat = unicodedata.category(ch)
+	if cp == 0xAD:
+		return 1
+	if cat in ('Mn', 'Me', 'Cf', 'Cc') or 0x1160 <= cp <= 0x11FF or cp == 0x200B:
+		return 0
+	if unicodedata.east_asian_width(ch) in ('W', 'F'):
+		return 2
+	return 1
+
+
+blocks, index = [], []
+for start in range(0, LIMIT, BLOCK):
+	packed = bytearray(BLOCK // 4)
+	for cp in range(start, start + BLOCK):
+		off = cp - start
+		packed[off >> 2] |= width(cp) << ((off & 3) * 2)
+	packed = bytes(packed)
+	if packed not in blocks:
+		blocks.append(packed)
+	index.append(blocks.index(packed))
+
+assert len(blocks) < 256
+
+out = sys.stdout
+out.write('/* generated by tools/rl_width.py from unicode %s, do not edit */\n\n' % unicodedata.unidata_version)
+out.write('#define RL_WIDTH_BLOCK  %u\n' % BLOCK)
+out.write('#define RL_WIDTH_LIMIT  0x%X\n\n' % LIMIT)
+out.write('static const unsigned char rl_width_index[%u] = {' % len(index))
+for i, b in enumerate(index):
+	out.write(('\n\t' if i % 16 == 0 else ' ') + '%3u,' % b)
+out.write('\n};\n\n')
+out.write('static const unsigned char rl_width_blocks[%u][%u] = {\n' % (len(blocks), BLOCK // 4))
+for blk in blocks:
+	out.write('\t{')
+	for i, b in enumerate(blk):
+		out.write(('\n\t\t' if i % 16 == 0 else ' ') + '0x%02X,' % b)
+	out.write('\n\t},\n')
+out.write('};\n')